@@ -27,11 +27,13 @@
  */
 
 #include "bsdiff.h"
+#include "bspatch.h"
 
 #include <limits.h>
 #include <string.h>
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
 #define MEDIAN3(a,b,c) (((a)<(b)) ? \
 	((b)<(c) ? (b) : ((a)<(c) ? (c) : (a))) : \
 	((b)>(c) ? (b) : ((a)>(c) ? (c) : (a))))
@@ -220,13 +222,19 @@ struct bsdiff_request
 	const uint8_t* new;
 	int64_t newsize;
 	struct bsdiff_stream* stream;
-	int64_t *I;
+	const int64_t *I;
 	uint8_t *buffer;
+	/* Scan starts at new[scanstart] with old position scanpos */
+	int64_t scanstart;
+	int64_t scanpos;
+	/* When fixend is set, the last record seeks to endpos */
+	int fixend;
+	int64_t endpos;
 };
 
 static int bsdiff_internal(const struct bsdiff_request req)
 {
-	int64_t *I,*V;
+	const int64_t *I;
 	int64_t scan,pos,len;
 	int64_t lastscan,lastpos,lastoffset,lastwrittenscan,lastwrittenpos;
 	int64_t ctrlcur[3], ctrlnext[3];
@@ -236,17 +244,14 @@ static int bsdiff_internal(const struct bsdiff_request req)
 	int64_t i;
 	uint8_t *buffer;
 
-	if((V=req.stream->malloc((req.oldsize+1)*sizeof(int64_t)))==NULL) return -1;
 	I = req.I;
-
-	qsufsort(I,V,req.old,req.oldsize);
-	req.stream->free(V);
-
 	buffer = req.buffer;
 
 	/* Compute the differences, writing ctrl as we go */
-	scan=0;len=0;pos=0;
-	lastscan=0;lastpos=0;lastoffset=lastwrittenscan=lastwrittenpos=0;
+	scan=req.scanstart;len=0;pos=0;
+	lastscan=lastwrittenscan=req.scanstart;
+	lastpos=lastwrittenpos=req.scanpos;
+	lastoffset=req.scanpos-req.scanstart;
 	ctrlcur[0]=ctrlcur[1]=ctrlcur[2]=0;
 	while(scan<req.newsize) {
 		oldscore=0;
@@ -343,7 +348,10 @@ static int bsdiff_internal(const struct bsdiff_request req)
 		};
 	};
 
-	if (ctrlcur[0]||ctrlcur[1]) {
+	if (req.fixend)
+		ctrlcur[2]=req.endpos-(lastwrittenpos+ctrlcur[0]);
+
+	if (ctrlcur[0]||ctrlcur[1]||(req.fixend&&ctrlcur[2])) {
 		offtout(ctrlcur);
 		offtout(ctrlcur + 1);
 		offtout(ctrlcur + 2);
@@ -368,79 +376,435 @@ static int bsdiff_internal(const struct bsdiff_request req)
 	return 0;
 }
 
-int bsdiff(const uint8_t* source, int64_t sourcesize, const uint8_t* target, int64_t targetsize, struct bsdiff_stream* stream)
+int bsdiff_index_create(struct bsdiff_index * index, const uint8_t * source,
+                        int64_t sourcesize, struct bsdiff_stream * stream)
 {
-	int result;
-	struct bsdiff_request req;
+	int64_t *V;
 
-	if((req.I=stream->malloc((sourcesize+1)*sizeof(int64_t)))==NULL)
+	index->source = source;
+	index->sourcesize = sourcesize;
+
+	if((index->I=stream->malloc((sourcesize+1)*sizeof(int64_t)))==NULL)
 		return -1;
 
-	if((req.buffer=stream->malloc(targetsize+1))==NULL)
+	if((V=stream->malloc((sourcesize+1)*sizeof(int64_t)))==NULL)
 	{
-		stream->free(req.I);
+		stream->free(index->I);
+		index->I = NULL;
 		return -1;
 	}
 
-	req.old = source;
-	req.oldsize = sourcesize;
-	req.new = target;
-	req.newsize = targetsize;
-	req.stream = stream;
+	qsufsort(index->I,V,source,sourcesize);
+	stream->free(V);
+
+	return 0;
+}
+
+void bsdiff_index_free(struct bsdiff_index * index, struct bsdiff_stream * stream)
+{
+	stream->free(index->I);
+	index->I = NULL;
+}
+
+static void bsdiff_request_init(struct bsdiff_request * req, const struct bsdiff_index * index,
+                                const uint8_t * target, int64_t targetsize,
+                                struct bsdiff_stream * stream)
+{
+	req->old = index->source;
+	req->oldsize = index->sourcesize;
+	req->new = target;
+	req->newsize = targetsize;
+	req->stream = stream;
+	req->I = index->I;
+	req->scanstart = 0;
+	req->scanpos = 0;
+	req->fixend = 0;
+	req->endpos = 0;
+}
+
+int bsdiff_indexed(const struct bsdiff_index * index, const uint8_t * target,
+                   int64_t targetsize, struct bsdiff_stream * stream)
+{
+	int result;
+	struct bsdiff_request req;
+
+	bsdiff_request_init(&req, index, target, targetsize, stream);
+
+	if((req.buffer=stream->malloc(targetsize+1))==NULL)
+		return -1;
 
 	result = bsdiff_internal(req);
 
 	stream->free(req.buffer);
-	stream->free(req.I);
 
 	return result;
 }
 
-#if defined(BSDIFF_EXECUTABLE)
+// Context scanned again around changed ranges by bsdiff_incremental.
+#define BSDIFF_INCREMENTAL_MARGIN 65536
 
-#include <bzlib.h>
-#include "bsdiff_common.h"
+// Targets of the same size are compared in blocks of this size.
+#define BSDIFF_INCREMENTAL_BLOCK 4096
+
+// Diff and extra data of old patch is skipped in slabs of this size.
+#define BSDIFF_INCREMENTAL_SLAB 65536
 
-static int bz2_write(struct bsdiff_stream * stream, const void * buffer,
-                     size_t size, ATTR_UNUSED enum bsdiff_stream_type type)
+// Record of old patch in absolute positions.
+struct bsdiff_record
 {
-	int bz2err;
-	BZFILE* bz2;
+	int64_t newpos;
+	int64_t oldpos;
+	int64_t difflen;
+	int64_t extralen;
+};
+
+// Reads control data of old patch and skips its diff and extra data. Records
+// without data are dropped, their seeks are kept in absolute positions.
+static int bsdiff_read_records(struct bspatch_stream * patch, int64_t targetsize,
+                               int64_t sourcesize, struct bsdiff_stream * stream,
+                               uint8_t * scratch, struct bsdiff_record ** records,
+                               int64_t * count)
+{
+	int64_t oldpos = 0, newpos = 0, capacity = 0;
+	int64_t ctrl[3];
+
+	*records = NULL;
+	*count = 0;
+
+	while (newpos < targetsize)
+	{
+		if (patch->read(patch, ctrl, sizeof(ctrl), BSDIFF_READCONTROL))
+			return -1;
+
+		// Conversion between two's complement and signed magnitude is its own inverse.
+		for (int i = 0; i <= 2; ++i)
+			offtout(ctrl + i);
+
+		// Checks sanity of control data.
+		if (ctrl[0] < 0 || ctrl[0] > targetsize - newpos ||
+		    ctrl[1] < 0 || ctrl[1] > targetsize - newpos - ctrl[0])
+			return -1;
+		if (ctrl[0] && (oldpos < 0 || oldpos + ctrl[0] < 0 || oldpos + ctrl[0] > sourcesize))
+			return -1;
+
+		// Skips diff and extra data.
+		for (int64_t done = 0, len; done < ctrl[0] + ctrl[1]; done += len)
+		{
+			const int diff = done < ctrl[0];
+			len = MIN((diff ? ctrl[0] : ctrl[0] + ctrl[1]) - done, BSDIFF_INCREMENTAL_SLAB);
+			if (patch->read(patch, scratch, (size_t)len, diff ? BSDIFF_READDIFF : BSDIFF_READEXTRA))
+				return -1;
+		}
+
+		if (ctrl[0] || ctrl[1])
+		{
+			if (*count == capacity)
+			{
+				struct bsdiff_record * grown;
+				capacity = capacity ? capacity * 2 : 1024;
+				if ((grown = stream->malloc((size_t)capacity * sizeof(*grown))) == NULL)
+					return -1;
+				if (*records)
+				{
+					memcpy(grown, *records, (size_t)*count * sizeof(*grown));
+					stream->free(*records);
+				}
+				*records = grown;
+			}
+
+			(*records)[*count].newpos = newpos;
+			(*records)[*count].oldpos = oldpos;
+			(*records)[*count].difflen = ctrl[0];
+			(*records)[(*count)++].extralen = ctrl[1];
+		}
+
+		newpos += ctrl[0] + ctrl[1];
+		oldpos += ctrl[0] + ctrl[2];
+	}
+
+	return 0;
+}
+
+// Writes single record; its data is regenerated from target and source.
+static int bsdiff_write_record(const struct bsdiff_request * req, const struct bsdiff_record * record,
+                               int64_t nextoldpos)
+{
+	int64_t ctrl[3];
+
+	ctrl[0] = record->difflen;
+	ctrl[1] = record->extralen;
+	ctrl[2] = nextoldpos - (record->oldpos + record->difflen);
+	for (int i = 0; i <= 2; ++i)
+		offtout(ctrl + i);
+
+	if (writedata(req->stream, ctrl, sizeof(ctrl), BSDIFF_WRITECONTROL))
+		return -1;
+
+	for (int64_t i = 0; i < record->difflen; ++i)
+		req->buffer[i] = req->new[record->newpos + i] - req->old[record->oldpos + i];
+	if (writedata(req->stream, req->buffer, record->difflen, BSDIFF_WRITEDIFF))
+		return -1;
+
+	if (writedata(req->stream, req->new + record->newpos + record->difflen,
+	              record->extralen, BSDIFF_WRITEEXTRA))
+		return -1;
+
+	return 0;
+}
+
+// Writes records of old target range [from, to) shifted by delta in target,
+// splitting records at the range boundaries. Last record seeks to endpos.
+static int bsdiff_write_records(const struct bsdiff_request * req, const struct bsdiff_record * records,
+                                int64_t count, int64_t from, int64_t to, int64_t delta, int64_t endpos)
+{
+	struct bsdiff_record pending;
+	int havepending = 0;
+
+	for (int64_t k = 0; k < count; ++k)
+	{
+		const struct bsdiff_record * r = records + k;
+		const int64_t start = MAX(r->newpos, from);
+		const int64_t end = MIN(r->newpos + r->difflen + r->extralen, to);
+		const int64_t diffend = r->newpos + r->difflen;
+		struct bsdiff_record clipped;
+
+		if (start >= end)
+			continue;
+
+		clipped.newpos = start + delta;
+		clipped.oldpos = r->oldpos + MIN(start - r->newpos, r->difflen);
+		clipped.difflen = MAX(MIN(end, diffend) - start, 0);
+		clipped.extralen = end - MAX(start, diffend);
+		if (clipped.extralen < 0)
+			clipped.extralen = 0;
+
+		if (havepending && bsdiff_write_record(req, &pending, clipped.oldpos))
+			return -1;
+		pending = clipped;
+		havepending = 1;
+	}
 
-	bz2 = (BZFILE*)stream->opaque;
-	BZ2_bzWrite(&bz2err, bz2, (void*)buffer, size);
-	if (bz2err != BZ_STREAM_END && bz2err != BZ_OK)
+	if (havepending && bsdiff_write_record(req, &pending, endpos))
 		return -1;
 
 	return 0;
 }
 
+// Returns old position that bspatch reaches at old target position pos.
+static int64_t bsdiff_record_oldpos(const struct bsdiff_record * records, int64_t count, int64_t pos)
+{
+	for (int64_t k = 0; k < count; ++k)
+		if (pos < records[k].newpos + records[k].difflen + records[k].extralen)
+			return records[k].oldpos + MIN(MAX(pos - records[k].newpos, 0), records[k].difflen);
+
+	return count ? records[count-1].oldpos + records[count-1].difflen : 0;
+}
+
+// Writes records of old target from written up to changed range [cutstart, cutend)
+// and scans the range again. Target is shifted by delta only after the range.
+static int bsdiff_rescan(struct bsdiff_request req, const struct bsdiff_record * records,
+                         int64_t count, int64_t oldtargetsize, int64_t written,
+                         int64_t cutstart, int64_t cutend, int64_t delta)
+{
+	// Old position entering the changed range must be valid for the scan.
+	req.scanstart = cutstart;
+	req.scanpos = cutstart ? bsdiff_record_oldpos(records, count, cutstart) : 0;
+	req.scanpos = MAX(MIN(req.scanpos, req.oldsize), 0);
+	req.newsize = cutend + delta;
+	req.fixend = cutend < oldtargetsize;
+	req.endpos = bsdiff_record_oldpos(records, count, cutend);
+
+	if (bsdiff_write_records(&req, records, count, written, cutstart, 0, req.scanpos))
+		return -1;
+	return bsdiff_internal(req);
+}
+
+int bsdiff_incremental(const struct bsdiff_index * index, const uint8_t * oldtarget,
+                       int64_t oldtargetsize, struct bspatch_stream * oldpatch,
+                       const uint8_t * target, int64_t targetsize,
+                       struct bsdiff_stream * stream)
+{
+	int result = -1;
+	struct bsdiff_request req;
+	struct bsdiff_record * records = NULL;
+	int64_t count, prefix, suffix, runstart, runend, written, delta;
+	uint8_t * scratch;
+
+	bsdiff_request_init(&req, index, target, targetsize, stream);
+	req.buffer = NULL;
+
+	if ((scratch = stream->malloc(BSDIFF_INCREMENTAL_SLAB)) == NULL)
+		return -1;
+	if ((req.buffer = stream->malloc(targetsize + 1)) == NULL)
+		goto cleanup;
+
+	if (bsdiff_read_records(oldpatch, oldtargetsize, index->sourcesize, stream,
+	                        scratch, &records, &count))
+		goto cleanup;
+
+	// Finds changed range as common prefix and suffix of both targets.
+	prefix = matchlen(oldtarget, oldtargetsize, target, targetsize);
+	for (suffix = 0; suffix < MIN(oldtargetsize, targetsize) - prefix; ++suffix)
+		if (oldtarget[oldtargetsize-suffix-1] != target[targetsize-suffix-1])
+			break;
+
+	delta = targetsize - oldtargetsize;
+	runstart = runend = prefix;
+	written = 0;
+
+	// Targets of the same size are compared block by block in between and
+	// runs of changed blocks further apart than two margins are scanned
+	// separately. Otherwise the whole range is scanned at once.
+	if (delta == 0)
+	{
+		for (int64_t pos = prefix, len; pos < oldtargetsize - suffix; pos += len)
+		{
+			len = MIN(oldtargetsize - suffix - pos, BSDIFF_INCREMENTAL_BLOCK);
+			if (memcmp(oldtarget + pos, target + pos, (size_t)len) == 0)
+				continue;
+
+			if (pos - runend > 2 * BSDIFF_INCREMENTAL_MARGIN)
+			{
+				if (bsdiff_rescan(req, records, count, oldtargetsize, written,
+				                  MAX(runstart - BSDIFF_INCREMENTAL_MARGIN, 0),
+				                  runend + BSDIFF_INCREMENTAL_MARGIN, 0))
+					goto cleanup;
+				written = runend + BSDIFF_INCREMENTAL_MARGIN;
+				runstart = pos;
+			}
+			runend = pos + len;
+		}
+	}
+	else
+		runend = oldtargetsize - suffix;
+
+	// Widens the last range by margin so the scan can align to the old matches
+	// and reuses records after it.
+	runstart = MAX(runstart - BSDIFF_INCREMENTAL_MARGIN, 0);
+	runend = MIN(runend + BSDIFF_INCREMENTAL_MARGIN, oldtargetsize);
+	if (bsdiff_rescan(req, records, count, oldtargetsize, written, runstart, runend, delta))
+		goto cleanup;
+	if (bsdiff_write_records(&req, records, count, runend, oldtargetsize, delta, 0))
+		goto cleanup;
+
+	result = 0;
+
+cleanup:
+	if (records)
+		stream->free(records);
+	if (req.buffer)
+		stream->free(req.buffer);
+	stream->free(scratch);
+	return result;
+}
+
+int bsdiff(const uint8_t* source, int64_t sourcesize, const uint8_t* target, int64_t targetsize, struct bsdiff_stream* stream)
+{
+	int result;
+	struct bsdiff_index index;
+
+	if (bsdiff_index_create(&index, source, sourcesize, stream))
+		return -1;
+
+	result = bsdiff_indexed(&index, target, targetsize, stream);
+
+	bsdiff_index_free(&index, stream);
+
+	return result;
+}
+
+int bsdiff_multi(const uint8_t * const * sources, const int64_t * sourcesizes, int sourcecount,
+                 const uint8_t * target, int64_t targetsize, struct bsdiff_stream * stream)
+{
+	int result;
+	uint8_t * source;
+	int64_t sourcesize = 0;
+
+	if (sourcecount == 1)
+		return bsdiff(sources[0], sourcesizes[0], target, targetsize, stream);
+
+	for (int i = 0; i < sourcecount; ++i)
+		sourcesize += sourcesizes[i];
+
+	// References are indexed together as one concatenated source.
+	if ((source = stream->malloc(sourcesize + 1)) == NULL)
+		return -1;
+	for (int64_t i = 0, pos = 0; i < sourcecount; pos += sourcesizes[i++])
+		memcpy(source + pos, sources[i], (size_t)sourcesizes[i]);
+
+	result = bsdiff(source, sourcesize, target, targetsize, stream);
+
+	stream->free(source);
+	return result;
+}
+
+#if defined(BSDIFF_EXECUTABLE)
+
+#include "bsdiff_common.h"
+
 int main(int argc,char *argv[])
 {
 	FILE * fp;
-	uint8_t * source, * target;
-	int64_t sourcesize, targetsize;
+	uint8_t ** sources, * target;
+	int64_t * sourcesizes, targetsize;
 	BZFILE * bz2;
 	int bz2err;
+	int argi = 1, filter, sourcecount;
+	const char * targetpath, * patchpath;
+	const char * err;
+	struct bsdiff_header header;
 	struct bsdiff_stream stream;
 
-	if (argc != 4)
-		errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
-
-	// Reads source file.
-	read_file_to_buffer(argv[1], &source, &sourcesize);
+	memset(&header, 0, sizeof(header));
+
+	// Parses options.
+	if ((err = parse_diff_options(argc, argv, &argi, &header)) != NULL)
+		errx(1, "%s (%s)\n", err, argv[argi]);
+	filter = (int)((header.flags & BSDIFF_HEADER_FILTER_MASK) >> BSDIFF_HEADER_FILTER_SHIFT);
+
+	sourcecount = argc - argi - 2;
+	if (sourcecount < 1 || sourcecount > BSDIFF_HEADER_MAX_REFERENCES)
+		errx(1, "usage: %s [-d] [-f x86|arm64] oldfile [oldfile ...] newfile patchfile\n", argv[0]);
+	targetpath = argv[argc-2];
+	patchpath = argv[argc-1];
+	header.flags |= (uint64_t)(sourcecount - 1) << BSDIFF_HEADER_REFERENCES_SHIFT;
+
+	// Reads source files (references), applying executable filter.
+	if ((sources = malloc(sourcecount * sizeof(*sources))) == NULL ||
+	    (sourcesizes = malloc(sourcecount * sizeof(*sourcesizes))) == NULL)
+		errx(1, "malloc");
+	for (int i = 0; i < sourcecount; ++i)
+	{
+		read_file_to_buffer(argv[argi+i], &sources[i], &sourcesizes[i]);
+		bsdiff_filter_encode(sources[i], sourcesizes[i], filter);
+	}
 
-	// Reads target file.
-	read_file_to_buffer(argv[2], &target, &targetsize);
+	// Reads target file, applying executable filter.
+	read_file_to_buffer(targetpath, &target, &targetsize);
+	bsdiff_filter_encode(target, targetsize, filter);
 
 	// Creates patch file.
-	if ((fp = fopen(argv[3], "wb")) == NULL)
-		errx(1, "fopen (%s)", argv[3]);
+	if ((fp = fopen(patchpath, "wb")) == NULL)
+		errx(1, "fopen (%s)", patchpath);
 
-	// Writes patch header (signature + newsize)
-	if (fwrite("ENDSLEY/BSDIFF43", 1, 16, fp) != 16 ||
-		fwrite(&targetsize, 1, sizeof(targetsize), fp) != sizeof(targetsize))
-		errx(1, "fwrite (%s)", argv[3]);
+	// Writes patch header (signature + newsize, optionally digests, filter
+	// and number of references)
+	header.targetsize = targetsize;
+	if (header.flags & BSDIFF_HEADER_SOURCE_DIGEST)
+	{
+		struct bsdiff_digest_state digest;
+		bsdiff_digest_init(&digest);
+		for (int i = 0; i < sourcecount; ++i)
+		{
+			header.sourcesize += sourcesizes[i];
+			bsdiff_digest_update(&digest, sources[i], (size_t)sourcesizes[i]);
+		}
+		header.sourcedigest = bsdiff_digest_final(&digest);
+	}
+	if (header.flags & BSDIFF_HEADER_TARGET_DIGEST)
+		header.targetdigest = bsdiff_digest(target, targetsize);
+	if ((err = write_header(fp, &header)) != NULL)
+		errx(1, "%s (%s)", err, patchpath);
 
 	// Opens bzip2 stream.
 	if ((bz2 = BZ2_bzWriteOpen(&bz2err, fp, 9, 0, 0)) == NULL)
@@ -451,7 +815,8 @@ int main(int argc,char *argv[])
 	stream.malloc = malloc;
 	stream.free = free;
 	stream.write = bz2_write;
-	if (bsdiff(source, sourcesize, target, targetsize, &stream))
+	if (bsdiff_multi((const uint8_t * const *)sources, sourcesizes, sourcecount,
+	                 target, targetsize, &stream))
 		errx(1, "bsdiff");
 
 	// Closes patch file.
@@ -459,10 +824,13 @@ int main(int argc,char *argv[])
 	if (bz2err != BZ_OK)
 		errx(1, "BZ2_bzWriteClose (bz2err=%d)", bz2err);
 	if (fclose(fp) != 0)
-		errx(1, "fclose (%s)", argv[3]);
+		errx(1, "fclose (%s)", patchpath);
 
 	/* Free the memory we used */
-	free(source);
+	for (int i = 0; i < sourcecount; ++i)
+		free(sources[i]);
+	free(sources);
+	free(sourcesizes);
 	free(target);
 
 	return 0;
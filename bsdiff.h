@@ -42,6 +42,8 @@ enum bsdiff_stream_type
 	BSDIFF_WRITEEXTRA
 };
 
+struct bspatch_stream;
+
 struct bsdiff_stream
 {
 	void * opaque;
@@ -55,6 +57,36 @@ struct bsdiff_stream
 int bsdiff(const uint8_t * source, int64_t sourcesize, const uint8_t * target,
            int64_t targetsize, struct bsdiff_stream * stream);
 
+// Suffix array of source. It can be created once and reused for several
+// targets. I holds sourcesize + 1 entries and may also be loaded from a cache.
+struct bsdiff_index
+{
+	const uint8_t * source;
+	int64_t sourcesize;
+	int64_t * I;
+};
+
+int bsdiff_index_create(struct bsdiff_index * index, const uint8_t * source,
+                        int64_t sourcesize, struct bsdiff_stream * stream);
+void bsdiff_index_free(struct bsdiff_index * index, struct bsdiff_stream * stream);
+
+int bsdiff_indexed(const struct bsdiff_index * index, const uint8_t * target,
+                   int64_t targetsize, struct bsdiff_stream * stream);
+
+// Re-diffs target that differs only slightly from oldtarget, reusing control
+// data of oldpatch (patch from index source to oldtarget). Only the changed
+// ranges plus a margin are scanned again; when target sizes differ, that is
+// the single range between common prefix and suffix.
+int bsdiff_incremental(const struct bsdiff_index * index, const uint8_t * oldtarget,
+                       int64_t oldtargetsize, struct bspatch_stream * oldpatch,
+                       const uint8_t * target, int64_t targetsize,
+                       struct bsdiff_stream * stream);
+
+// Diffs target against several references at once. Patch addresses them as
+// one source made of references concatenated in the given order.
+int bsdiff_multi(const uint8_t * const * sources, const int64_t * sourcesizes, int sourcecount,
+                 const uint8_t * target, int64_t targetsize, struct bsdiff_stream * stream);
+
 #ifdef __cplusplus
 }
 #endif // (__cplusplus)
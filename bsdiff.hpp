@@ -0,0 +1,297 @@
+/*-
+ * Copyright 2018-2020 Emanuel Komínek
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSDIFF_HPP
+#define BSDIFF_HPP
+
+// Header-only C++20 interface on top of bsdiff.c and bspatch.c.
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory_resource>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+#include "bsdiff.h"
+#include "bspatch.h"
+
+namespace bsdiffpp
+{
+
+class error : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Sink receives patch data: bool(std::span<const std::uint8_t>, bsdiff_stream_type).
+template <class T>
+concept sink = requires(T & t, std::span<const std::uint8_t> data, bsdiff_stream_type type)
+{
+	{ t(data, type) } -> std::convertible_to<bool>;
+};
+
+// Source fills whole span with patch data: bool(std::span<std::uint8_t>, bspatch_stream_type).
+template <class T>
+concept source = requires(T & t, std::span<std::uint8_t> data, bspatch_stream_type type)
+{
+	{ t(data, type) } -> std::convertible_to<bool>;
+};
+
+namespace detail
+{
+
+// Allocation callbacks of bsdiff_stream carry no context, so the resource of
+// the running call is passed through thread local pointer.
+inline thread_local std::pmr::memory_resource * current_resource = nullptr;
+
+constexpr std::size_t allocation_header = alignof(std::max_align_t);
+
+inline void * allocate(std::size_t size) noexcept
+{
+	try
+	{
+		auto * p = static_cast<std::byte *>(current_resource->allocate(
+			size + allocation_header, alignof(std::max_align_t)));
+		*reinterpret_cast<std::size_t *>(p) = size;
+		return p + allocation_header;
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+inline void deallocate(void * ptr) noexcept
+{
+	if (ptr == nullptr)
+		return;
+	auto * p = static_cast<std::byte *>(ptr) - allocation_header;
+	current_resource->deallocate(p, *reinterpret_cast<std::size_t *>(p) + allocation_header,
+	                             alignof(std::max_align_t));
+}
+
+class resource_scope
+{
+public:
+	explicit resource_scope(std::pmr::memory_resource * resource) noexcept
+		: previous_(std::exchange(current_resource, resource)) {}
+	~resource_scope() { current_resource = previous_; }
+	resource_scope(const resource_scope &) = delete;
+	resource_scope & operator=(const resource_scope &) = delete;
+
+private:
+	std::pmr::memory_resource * previous_;
+};
+
+template <class Callback>
+struct context
+{
+	Callback & callback;
+	std::exception_ptr exception;
+};
+
+// Trampolines are instantiated per callback type so the call is inlined.
+template <class Sink>
+int write(bsdiff_stream * stream, const void * buffer, std::size_t size, bsdiff_stream_type type)
+{
+	auto * ctx = static_cast<context<Sink> *>(stream->opaque);
+	try
+	{
+		return ctx->callback(std::span(static_cast<const std::uint8_t *>(buffer), size), type) ? 0 : -1;
+	}
+	catch (...)
+	{
+		ctx->exception = std::current_exception();
+		return -1;
+	}
+}
+
+template <class Source>
+int read(const bspatch_stream * stream, void * buffer, std::size_t length, bspatch_stream_type type)
+{
+	auto * ctx = static_cast<context<Source> *>(stream->opaque);
+	try
+	{
+		return ctx->callback(std::span(static_cast<std::uint8_t *>(buffer), length), type) ? 0 : -1;
+	}
+	catch (...)
+	{
+		ctx->exception = std::current_exception();
+		return -1;
+	}
+}
+
+template <class Callback>
+void check(int result, const context<Callback> & ctx, const char * what)
+{
+	if (ctx.exception)
+		std::rethrow_exception(ctx.exception);
+	if (result != 0)
+		throw error(what);
+}
+
+inline bsdiff_stream make_stream(void * opaque, decltype(bsdiff_stream::write) write) noexcept
+{
+	bsdiff_stream stream;
+	stream.opaque = opaque;
+	stream.malloc = allocate;
+	stream.free = deallocate;
+	stream.write = write;
+	return stream;
+}
+
+} // namespace detail
+
+// Suffix array of source (see bsdiff_index). Source must outlive the index.
+class index
+{
+public:
+	explicit index(std::span<const std::uint8_t> source,
+	               std::pmr::memory_resource * resource = std::pmr::get_default_resource())
+		: resource_(resource)
+	{
+		detail::resource_scope scope(resource_);
+		bsdiff_stream stream = detail::make_stream(nullptr, nullptr);
+		if (bsdiff_index_create(&index_, source.data(), static_cast<std::int64_t>(source.size()), &stream))
+			throw std::bad_alloc();
+	}
+
+	~index() { reset(); }
+
+	index(index && other) noexcept
+		: index_(std::exchange(other.index_, bsdiff_index{})), resource_(other.resource_) {}
+
+	index & operator=(index && other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			index_ = std::exchange(other.index_, bsdiff_index{});
+			resource_ = other.resource_;
+		}
+		return *this;
+	}
+
+	index(const index &) = delete;
+	index & operator=(const index &) = delete;
+
+	std::span<const std::uint8_t> source() const noexcept
+	{
+		return { index_.source, static_cast<std::size_t>(index_.sourcesize) };
+	}
+
+	const bsdiff_index * get() const noexcept { return &index_; }
+	std::pmr::memory_resource * resource() const noexcept { return resource_; }
+
+private:
+	void reset() noexcept
+	{
+		if (index_.I == nullptr)
+			return;
+		detail::resource_scope scope(resource_);
+		bsdiff_stream stream = detail::make_stream(nullptr, nullptr);
+		bsdiff_index_free(&index_, &stream);
+	}
+
+	bsdiff_index index_{};
+	std::pmr::memory_resource * resource_;
+};
+
+// Diffs target against indexed source, working buffer comes from index resource.
+template <sink Sink>
+void diff(const index & source, std::span<const std::uint8_t> target, Sink && out)
+{
+	detail::context<std::remove_reference_t<Sink>> ctx{ out, nullptr };
+	detail::resource_scope scope(source.resource());
+	bsdiff_stream stream = detail::make_stream(&ctx, detail::write<std::remove_reference_t<Sink>>);
+	detail::check(bsdiff_indexed(source.get(), target.data(), static_cast<std::int64_t>(target.size()), &stream),
+	              ctx, "bsdiff");
+}
+
+template <sink Sink>
+void diff(std::span<const std::uint8_t> source, std::span<const std::uint8_t> target, Sink && out,
+          std::pmr::memory_resource * resource = std::pmr::get_default_resource())
+{
+	detail::context<std::remove_reference_t<Sink>> ctx{ out, nullptr };
+	detail::resource_scope scope(resource);
+	bsdiff_stream stream = detail::make_stream(&ctx, detail::write<std::remove_reference_t<Sink>>);
+	detail::check(bsdiff(source.data(), static_cast<std::int64_t>(source.size()), target.data(),
+	                     static_cast<std::int64_t>(target.size()), &stream),
+	              ctx, "bsdiff");
+}
+
+// Applies patch and returns digest of target.
+template <source Source>
+std::uint64_t patch(std::span<const std::uint8_t> source, std::span<std::uint8_t> target, Source && in)
+{
+	detail::context<std::remove_reference_t<Source>> ctx{ in, nullptr };
+	bspatch_stream stream;
+	std::uint64_t digest = 0;
+	stream.opaque = &ctx;
+	stream.read = detail::read<std::remove_reference_t<Source>>;
+	detail::check(bspatch_digest(source.data(), static_cast<std::int64_t>(source.size()), target.data(),
+	                             static_cast<std::int64_t>(target.size()), &stream, &digest),
+	              ctx, "bspatch");
+	return digest;
+}
+
+// Push-based patching (see bspatch_begin). Target is hashed only when digest is set.
+class patcher
+{
+public:
+	patcher(std::span<const std::uint8_t> source, std::span<std::uint8_t> target, bool digest = false)
+	{
+		if (bspatch_begin(&state_, source.data(), static_cast<std::int64_t>(source.size()),
+		                  target.data(), static_cast<std::int64_t>(target.size()), digest))
+			throw error("bspatch_begin");
+	}
+
+	void feed(std::span<const std::uint8_t> data)
+	{
+		if (bspatch_feed(&state_, data.data(), data.size()))
+			throw error("bspatch_feed");
+	}
+
+	// Checks that the patch was complete and returns digest of target (0 when
+	// the patcher was created without digest).
+	std::uint64_t finish()
+	{
+		std::uint64_t digest = 0;
+		if (bspatch_finish(&state_, state_.digesting ? &digest : nullptr))
+			throw error("bspatch_finish");
+		return digest;
+	}
+
+private:
+	bspatch_state state_;
+};
+
+} // namespace bsdiffpp
+
+#endif // (BSDIFF_HPP)
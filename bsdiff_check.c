@@ -0,0 +1,300 @@
+/*-
+ * Copyright 2018-2020 Emanuel Komínek
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Checks library interfaces that command line tools do not exercise:
+//   bsdiff_check oldfile newfile
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsdiff.h"
+#include "bspatch.h"
+
+// Growable in-memory patch.
+struct buffer
+{
+	uint8_t * data;
+	size_t size, capacity;
+};
+
+// Patch reader handing out at most piece bytes per call.
+struct reader
+{
+	const uint8_t * data;
+	size_t size, offset, piece;
+};
+
+static int read_file(const char * path, struct buffer * buffer)
+{
+	FILE * fp;
+	long size;
+	int err = -1;
+
+	memset(buffer, 0, sizeof(*buffer));
+	if ((fp = fopen(path, "rb")) == NULL)
+		return -1;
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+	    (buffer->data = malloc((size_t)size + 1)) != NULL &&
+	    fread(buffer->data, 1, (size_t)size, fp) == (size_t)size)
+	{
+		buffer->size = buffer->capacity = (size_t)size;
+		err = 0;
+	}
+	fclose(fp);
+
+	return err;
+}
+
+static int buffer_write(struct bsdiff_stream * stream, const void * data, size_t size,
+                        enum bsdiff_stream_type type)
+{
+	struct buffer * buffer = (struct buffer *)stream->opaque;
+	(void)type;
+
+	if (size > buffer->capacity - buffer->size)
+	{
+		size_t capacity = buffer->capacity * 2 + size;
+		uint8_t * grown = realloc(buffer->data, capacity);
+		if (grown == NULL)
+			return -1;
+		buffer->data = grown;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+
+	return 0;
+}
+
+static int reader_view(const struct bspatch_view_stream * stream, const void ** buffer,
+                       size_t * length, enum bspatch_stream_type type)
+{
+	struct reader * reader = (struct reader *)stream->opaque;
+	size_t available = reader->size - reader->offset;
+	(void)type;
+
+	if (*length > reader->piece)
+		*length = reader->piece;
+	if (*length > available)
+		*length = available;
+	*buffer = reader->data + reader->offset;
+	reader->offset += *length;
+
+	return 0;
+}
+
+static int reader_read(const struct bspatch_stream * stream, void * buffer, size_t length,
+                       enum bspatch_stream_type type)
+{
+	struct reader * reader = (struct reader *)stream->opaque;
+	(void)type;
+
+	if (length > reader->size - reader->offset)
+		return -1;
+	memcpy(buffer, reader->data + reader->offset, length);
+	reader->offset += length;
+
+	return 0;
+}
+
+// Applies patch via view callback returning short pieces and compares result.
+static int check_view(const struct buffer * source, const struct buffer * target,
+                      const struct buffer * patch)
+{
+	static const size_t pieces[] = { 1, 7, 4096 };
+	const uint64_t expected = bsdiff_digest(target->data, (int64_t)target->size);
+	uint8_t * output = malloc(target->size + 1);
+	size_t i;
+	int err = 0;
+
+	if (output == NULL)
+		return -1;
+
+	for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]) && err == 0; ++i)
+	{
+		struct reader reader = { patch->data, patch->size, 0, pieces[i] };
+		struct bspatch_view_stream stream = { &reader, reader_view };
+		uint64_t digest = 0;
+
+		memset(output, 0, target->size);
+		if (bspatch_view(source->data, (int64_t)source->size, output, (int64_t)target->size,
+		                 &stream, &digest) != 0 || digest != expected ||
+		    memcmp(output, target->data, target->size) != 0 || reader.offset != patch->size)
+		{
+			fprintf(stderr, "bsdiff_check: view (pieces of %zu bytes)\n", pieces[i]);
+			err = -1;
+		}
+	}
+
+	free(output);
+	return err;
+}
+
+// Checks that bspatch_feed errors stick until bspatch_begin.
+static int check_feed(const struct buffer * source, const struct buffer * target,
+                      const struct buffer * patch)
+{
+	static const uint8_t corrupt[24] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	const uint8_t trailing = 0;
+	uint8_t * output = malloc(target->size + 1);
+	struct bspatch_state state;
+	uint64_t digest;
+	int err = 0;
+
+	if (output == NULL)
+		return -1;
+
+	// Data past the end of patch fails and so does finishing afterwards.
+	if (bspatch_begin(&state, source->data, (int64_t)source->size, output, (int64_t)target->size, 1) != 0 ||
+	    bspatch_feed(&state, patch->data, patch->size) != 0 ||
+	    bspatch_feed(&state, &trailing, 1) == 0 || bspatch_finish(&state, &digest) == 0)
+	{
+		fprintf(stderr, "bsdiff_check: feed (data past end)\n");
+		err = -1;
+	}
+
+	// Valid patch is refused after corrupt control data.
+	if (bspatch_begin(&state, source->data, (int64_t)source->size, output, (int64_t)target->size, 1) != 0 ||
+	    bspatch_feed(&state, corrupt, sizeof(corrupt)) == 0 ||
+	    bspatch_feed(&state, patch->data, patch->size) == 0 || bspatch_finish(&state, &digest) == 0)
+	{
+		fprintf(stderr, "bsdiff_check: feed (corrupt control data)\n");
+		err = -1;
+	}
+
+	free(output);
+	return err;
+}
+
+// Re-diffs target via bsdiff_incremental and checks that the patch applies.
+static int check_rediff(const struct bsdiff_index * index, const uint8_t * oldtarget,
+                        int64_t oldtargetsize, const struct buffer * oldpatch,
+                        const uint8_t * target, int64_t targetsize, const char * name)
+{
+	struct buffer patch = { NULL, 0, 0 };
+	struct bsdiff_stream stream = { &patch, malloc, free, buffer_write };
+	struct reader reader = { oldpatch->data, oldpatch->size, 0, SIZE_MAX };
+	struct bspatch_stream oldstream = { &reader, reader_read };
+	struct bspatch_view_stream view = { &reader, reader_view };
+	uint8_t * output = malloc((size_t)targetsize + 1);
+	int err = -1;
+
+	if (output != NULL &&
+	    bsdiff_incremental(index, oldtarget, oldtargetsize, &oldstream, target, targetsize, &stream) == 0)
+	{
+		reader.data = patch.data;
+		reader.size = patch.size;
+		reader.offset = 0;
+		if (bspatch_view(index->source, index->sourcesize, output, targetsize, &view, NULL) == 0 &&
+		    memcmp(output, target, (size_t)targetsize) == 0)
+			err = 0;
+	}
+
+	if (err)
+		fprintf(stderr, "bsdiff_check: incremental (%s)\n", name);
+	free(output);
+	free(patch.data);
+	return err;
+}
+
+// Checks bsdiff_incremental with edits far apart and with insertion on
+// generated data large enough to need several ranges.
+static int check_incremental(void)
+{
+	const int64_t size = 1 << 20, inserted = 16;
+	uint8_t * source = malloc((size_t)size), * oldtarget = malloc((size_t)size);
+	uint8_t * target = malloc((size_t)(size + inserted));
+	struct buffer oldpatch = { NULL, 0, 0 };
+	struct bsdiff_stream stream = { &oldpatch, malloc, free, buffer_write };
+	struct bsdiff_index index = { NULL, 0, NULL };
+	uint32_t seed = 1;
+	int err = -1;
+
+	if (source == NULL || oldtarget == NULL || target == NULL)
+		goto cleanup;
+
+	// Old target is source with scattered edits.
+	for (int64_t i = 0; i < size; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		source[i] = oldtarget[i] = (uint8_t)(seed >> 16);
+		if (i % 50000 == 0)
+			oldtarget[i] ^= 0x5a;
+	}
+
+	if (bsdiff_index_create(&index, source, size, &stream) != 0 ||
+	    bsdiff_indexed(&index, oldtarget, size, &stream) != 0)
+		goto cleanup;
+
+	// Edits in place far apart are scanned separately.
+	memcpy(target, oldtarget, (size_t)size);
+	memset(target + 100000, 0xaa, 100);
+	memset(target + 800000, 0x55, 100);
+	err = check_rediff(&index, oldtarget, size, &oldpatch, target, size, "edits");
+
+	// Insertion shifts the rest of target.
+	memcpy(target, oldtarget, 500000);
+	memset(target + 500000, 0xaa, (size_t)inserted);
+	memcpy(target + 500000 + inserted, oldtarget + 500000, (size_t)size - 500000);
+	if (check_rediff(&index, oldtarget, size, &oldpatch, target, size + inserted, "insertion"))
+		err = -1;
+
+cleanup:
+	bsdiff_index_free(&index, &stream);
+	free(oldpatch.data);
+	free(source);
+	free(oldtarget);
+	free(target);
+	return err;
+}
+
+int main(int argc, char * argv[])
+{
+	struct buffer source = { NULL, 0, 0 }, target = { NULL, 0, 0 }, patch = { NULL, 0, 0 };
+	struct bsdiff_stream stream = { &patch, malloc, free, buffer_write };
+	int err = 1;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: %s oldfile newfile\n", argv[0]);
+		return 1;
+	}
+
+	if (read_file(argv[1], &source) != 0 || read_file(argv[2], &target) != 0)
+		fprintf(stderr, "bsdiff_check: unable to read input\n");
+	else if (bsdiff(source.data, (int64_t)source.size, target.data, (int64_t)target.size, &stream) != 0)
+		fprintf(stderr, "bsdiff_check: bsdiff\n");
+	else if (check_view(&source, &target, &patch) == 0 && check_feed(&source, &target, &patch) == 0 &&
+	         check_incremental() == 0)
+		err = 0;
+
+	free(source.data);
+	free(target.data);
+	free(patch.data);
+
+	return err;
+}
@@ -26,16 +26,52 @@
 #ifndef BSDIFF_COMMON_H
 #define BSDIFF_COMMON_H
 
+#include <bzlib.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 
+#include "bsdiff.h"
+#include "bsdiff_filter.h"
+#include "bspatch.h"
+
 #ifndef min
 # define min(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+// Patch header flags (extended header only).
+#define BSDIFF_HEADER_SOURCE_DIGEST 0x1
+#define BSDIFF_HEADER_TARGET_DIGEST 0x2
+#define BSDIFF_HEADER_FILTER_MASK 0xFF00
+#define BSDIFF_HEADER_FILTER_SHIFT 8
+#define BSDIFF_HEADER_REFERENCES_MASK 0xFF0000
+#define BSDIFF_HEADER_REFERENCES_SHIFT 16
+#define BSDIFF_HEADER_MAX_REFERENCES 256
+#define BSDIFF_HEADER_KNOWN_FLAGS (BSDIFF_HEADER_SOURCE_DIGEST | BSDIFF_HEADER_TARGET_DIGEST | \
+                                   BSDIFF_HEADER_FILTER_MASK | BSDIFF_HEADER_REFERENCES_MASK)
+
+// Legacy header is magic + target size. Extended header (any flag set) is
+// magic + target size + flags + source size + source digest + target digest.
+// With a filter, digests cover filtered source and target. Number of
+// references minus one is kept in flags, source size and digest cover all
+// references concatenated.
+#define BSDIFF_HEADER_MAGIC "ENDSLEY/BSDIFF43"
+#define BSDIFF_HEADER_MAGIC_EXTENDED "ENDSLEY/BSDIFF4X"
+#define BSDIFF_HEADER_SIZE 24
+#define BSDIFF_HEADER_SIZE_EXTENDED 56
+
+struct bsdiff_header
+{
+	int64_t targetsize;
+	uint64_t flags;
+	int64_t sourcesize;
+	uint64_t sourcedigest;
+	uint64_t targetdigest;
+};
+
 static inline ATTR_NORETURN void errx(int eval, const char * fmt, ...)
 {
 	va_list args;
@@ -91,4 +127,126 @@ static inline void write_buffer_to_file(const char * path, uint8_t * output_buff
 		errx(1, "fclose (%s)", path);
 }
 
+// Writes patch header, returns NULL on success or error description.
+static inline const char * write_header(FILE * fp, const struct bsdiff_header * header)
+{
+	uint8_t buffer[BSDIFF_HEADER_SIZE_EXTENDED];
+	size_t size = BSDIFF_HEADER_SIZE;
+
+	memcpy(buffer, header->flags ? BSDIFF_HEADER_MAGIC_EXTENDED : BSDIFF_HEADER_MAGIC, 16);
+	memcpy(buffer + 16, &header->targetsize, 8);
+	if (header->flags)
+	{
+		memcpy(buffer + 24, &header->flags, 8);
+		memcpy(buffer + 32, &header->sourcesize, 8);
+		memcpy(buffer + 40, &header->sourcedigest, 8);
+		memcpy(buffer + 48, &header->targetdigest, 8);
+		size = BSDIFF_HEADER_SIZE_EXTENDED;
+	}
+
+	if (fwrite(buffer, 1, size, fp) != size)
+		return "fwrite";
+	return NULL;
+}
+
+// Reads patch header, returns NULL on success or error description.
+static inline const char * read_header(FILE * fp, struct bsdiff_header * header)
+{
+	uint8_t buffer[BSDIFF_HEADER_SIZE_EXTENDED];
+
+	memset(header, 0, sizeof(*header));
+	if (fread(buffer, 1, BSDIFF_HEADER_SIZE, fp) != BSDIFF_HEADER_SIZE)
+		return feof(fp) ? "Corrupt patch header" : "fread";
+
+	// Checks for appropriate magic and reads extended fields.
+	if (memcmp(buffer, BSDIFF_HEADER_MAGIC_EXTENDED, 16) == 0)
+	{
+		if (fread(buffer + BSDIFF_HEADER_SIZE, 1, BSDIFF_HEADER_SIZE_EXTENDED - BSDIFF_HEADER_SIZE, fp) !=
+		    BSDIFF_HEADER_SIZE_EXTENDED - BSDIFF_HEADER_SIZE)
+			return feof(fp) ? "Corrupt patch header" : "fread";
+		memcpy(&header->flags, buffer + 24, 8);
+		memcpy(&header->sourcesize, buffer + 32, 8);
+		memcpy(&header->sourcedigest, buffer + 40, 8);
+		memcpy(&header->targetdigest, buffer + 48, 8);
+		if (header->flags & ~(uint64_t)BSDIFF_HEADER_KNOWN_FLAGS)
+			return "Unsupported patch header (flags)";
+		if (header->sourcesize < 0)
+			return "Corrupt patch header (source size)";
+	}
+	else if (memcmp(buffer, BSDIFF_HEADER_MAGIC, 16) != 0)
+		return "Corrupt patch header (magic)";
+
+	memcpy(&header->targetsize, buffer + 16, 8);
+	if (header->targetsize < 0)
+		return "Corrupt patch header (target size)";
+
+	return NULL;
+}
+
+// Writes patch data into bzip2 stream (opaque is BZFILE).
+static inline int bz2_write(struct bsdiff_stream * stream, const void * buffer,
+                            size_t size, ATTR_UNUSED enum bsdiff_stream_type type)
+{
+	int bz2err;
+	size_t bytes_written = 0;
+	int to_write;
+	while ((to_write = (int)min(size - bytes_written, 1048576)) != 0)
+	{
+		BZ2_bzWrite(&bz2err, (BZFILE *)stream->opaque, (uint8_t *)buffer + bytes_written, to_write);
+		if (bz2err != BZ_OK)
+			return -1;
+		bytes_written += to_write;
+	}
+
+	return 0;
+}
+
+// Reads patch data from bzip2 stream (opaque is BZFILE).
+static inline int bz2_read(const struct bspatch_stream * stream, void * buffer,
+                           size_t length, ATTR_UNUSED enum bspatch_stream_type type)
+{
+	size_t bytes_read = 0;
+	int to_read;
+	while ((to_read = (int)min(length - bytes_read, 1048576)) != 0)
+	{
+		int bz2err;
+		if (BZ2_bzRead(&bz2err, (BZFILE *)stream->opaque, (uint8_t *)buffer + bytes_read, to_read) != to_read)
+			return -1;
+		bytes_read += to_read;
+	}
+
+	return 0;
+}
+
+// Parses bsdiff options (-d, -f x86|arm64) starting at argv[*argi] into
+// header flags. Stops at first argument that is not an option, returns NULL
+// on success or error description.
+static inline const char * parse_diff_options(int argc, char * argv[], int * argi,
+                                              struct bsdiff_header * header)
+{
+	for (; *argi < argc && argv[*argi][0] == '-'; ++*argi)
+	{
+		if (strcmp(argv[*argi], "-d") == 0)
+			header->flags |= BSDIFF_HEADER_SOURCE_DIGEST | BSDIFF_HEADER_TARGET_DIGEST;
+		else if (strcmp(argv[*argi], "-f") == 0 && *argi + 1 < argc)
+		{
+			uint64_t filter;
+
+			++*argi;
+			if (strcmp(argv[*argi], "x86") == 0)
+				filter = BSDIFF_FILTER_X86;
+			else if (strcmp(argv[*argi], "arm64") == 0)
+				filter = BSDIFF_FILTER_ARM64;
+			else
+				return "Unknown filter";
+			header->flags = (header->flags & ~(uint64_t)BSDIFF_HEADER_FILTER_MASK) |
+			                filter << BSDIFF_HEADER_FILTER_SHIFT;
+		}
+		else
+			return "Unknown option";
+	}
+
+	return NULL;
+}
+
 #endif
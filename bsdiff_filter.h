@@ -0,0 +1,120 @@
+/*-
+ * Copyright 2018-2020 Emanuel Komínek
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSDIFF_FILTER_H
+#define BSDIFF_FILTER_H
+
+#include <stdint.h>
+
+// Reversible executable filters (BCJ style). Relative branch targets are
+// converted to absolute ones, so moved code yields identical bytes.
+
+enum bsdiff_filter
+{
+	BSDIFF_FILTER_NONE = 0,
+	BSDIFF_FILTER_X86 = 1,
+	BSDIFF_FILTER_ARM64 = 2
+};
+
+static inline uint32_t bsdiff_filter_read32(const uint8_t * p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void bsdiff_filter_write32(uint8_t * p, uint32_t x)
+{
+	p[0] = (uint8_t)x;
+	p[1] = (uint8_t)(x >> 8);
+	p[2] = (uint8_t)(x >> 16);
+	p[3] = (uint8_t)(x >> 24);
+}
+
+// Converts rel32 of CALL (E8) and JMP (E9) with small displacement. Only low
+// 25 bits are converted and sign extended again, so the top byte stays 0x00
+// or 0xFF. Operand bytes are never scanned for opcodes, so decoding takes
+// the same decisions as encoding.
+static inline void bsdiff_filter_x86(uint8_t * buffer, int64_t size, int encode)
+{
+	for (int64_t i = 0; i + 5 <= size;)
+	{
+		if (buffer[i] != 0xE8 && buffer[i] != 0xE9)
+		{
+			++i;
+			continue;
+		}
+
+		if (buffer[i+4] == 0x00 || buffer[i+4] == 0xFF)
+		{
+			const uint32_t pos = (uint32_t)(i + 5);
+			uint32_t x = bsdiff_filter_read32(buffer + i + 1);
+			x = (encode ? x + pos : x - pos) & 0x01FFFFFF;
+			if (x & 0x01000000)
+				x |= 0xFF000000;
+			bsdiff_filter_write32(buffer + i + 1, x);
+		}
+		i += 5;
+	}
+}
+
+// Converts imm26 of BL instructions.
+static inline void bsdiff_filter_arm64(uint8_t * buffer, int64_t size, int encode)
+{
+	for (int64_t i = 0; i + 4 <= size; i += 4)
+	{
+		uint32_t x = bsdiff_filter_read32(buffer + i);
+		if ((x & 0xFC000000) == 0x94000000)
+		{
+			const uint32_t pos = (uint32_t)(i >> 2);
+			x = encode ? x + pos : x - pos;
+			bsdiff_filter_write32(buffer + i, 0x94000000 | (x & 0x03FFFFFF));
+		}
+	}
+}
+
+// Applies filter in place, returns 0 on success and -1 for unknown filter.
+static inline int bsdiff_filter_encode(uint8_t * buffer, int64_t size, int filter)
+{
+	switch (filter)
+	{
+	case BSDIFF_FILTER_NONE: return 0;
+	case BSDIFF_FILTER_X86: bsdiff_filter_x86(buffer, size, 1); return 0;
+	case BSDIFF_FILTER_ARM64: bsdiff_filter_arm64(buffer, size, 1); return 0;
+	default: return -1;
+	}
+}
+
+// Reverts filter in place, returns 0 on success and -1 for unknown filter.
+static inline int bsdiff_filter_decode(uint8_t * buffer, int64_t size, int filter)
+{
+	switch (filter)
+	{
+	case BSDIFF_FILTER_NONE: return 0;
+	case BSDIFF_FILTER_X86: bsdiff_filter_x86(buffer, size, 0); return 0;
+	case BSDIFF_FILTER_ARM64: bsdiff_filter_arm64(buffer, size, 0); return 0;
+	default: return -1;
+	}
+}
+
+#endif
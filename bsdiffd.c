@@ -0,0 +1,971 @@
+/*-
+ * Copyright 2018-2020 Emanuel Komínek
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Local diff/patch daemon. Accepts one job per connection on a Unix socket:
+//
+//   DIFF [-d] [-f x86|arm64] oldfile newfile patchfile
+//   PATCH oldfile newfile patchfile
+//
+// and answers with a single line "OK <id> <timings>" or "ERR <id> <reason>".
+// Source indexes are cached in cachedir, mapped into memory and kept in LRU
+// order up to cache size. Jobs run on a shared thread pool and are admitted
+// only while their estimated memory fits into the budget.
+
+#define _POSIX_C_SOURCE 200809L
+// Darwin hides _SC_NPROCESSORS_ONLN and _SC_PHYS_PAGES under strict POSIX.
+#define _DARWIN_C_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bsdiff.h"
+#include "bspatch.h"
+#include "bsdiff_common.h"
+
+#define BSDIFFD_QUEUE_SIZE 1024
+#define BSDIFFD_LINE_SIZE 4096
+#define BSDIFFD_MAX_ARGS 8
+#define BSDIFFD_MAX_PENDING 256
+#define BSDIFFD_TIMEOUT 5000
+
+// Parsed request. Arguments are offsets of tokens in line.
+struct job
+{
+	int fd;
+	uint64_t id;
+	struct timespec accepted, received;
+	int argc;
+	size_t args[BSDIFFD_MAX_ARGS];
+	char line[BSDIFFD_LINE_SIZE];
+};
+
+// Connection whose request line is still being read.
+struct connection
+{
+	struct job job;
+	size_t length;
+};
+
+struct timings
+{
+	double queued, admitted, index, run, total;
+	const char * cache;
+};
+
+struct cache_entry
+{
+	uint64_t digest;
+	int64_t sourcesize;
+	int64_t * I;
+	size_t mapsize;
+	int ready, failed, refs;
+	struct cache_entry * prev, * next;
+};
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t notempty, notfull;
+	struct job jobs[BSDIFFD_QUEUE_SIZE];
+	size_t head, count;
+} queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, {{0}}, 0, 0 };
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t released;
+	int64_t used, limit;
+} budget = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t ready;
+	struct cache_entry * head, * tail;
+	int64_t size, limit;
+	const char * dir;
+} cache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, NULL };
+
+static double elapsed(const struct timespec * since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - since->tv_sec) * 1000.0 + (double)(now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// Waits until estimated memory of a job fits into the budget. A job that is
+// larger than the whole budget runs alone.
+static void budget_acquire(int64_t bytes)
+{
+	pthread_mutex_lock(&budget.mutex);
+	while (budget.used > 0 && budget.used + bytes > budget.limit)
+		pthread_cond_wait(&budget.released, &budget.mutex);
+	budget.used += bytes;
+	pthread_mutex_unlock(&budget.mutex);
+}
+
+static void budget_release(int64_t bytes)
+{
+	pthread_mutex_lock(&budget.mutex);
+	budget.used -= bytes;
+	pthread_cond_broadcast(&budget.released);
+	pthread_mutex_unlock(&budget.mutex);
+}
+
+static void cache_unlink(struct cache_entry * entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache.head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void cache_push_front(struct cache_entry * entry)
+{
+	entry->prev = NULL;
+	entry->next = cache.head;
+	if (cache.head)
+		cache.head->prev = entry;
+	else
+		cache.tail = entry;
+	cache.head = entry;
+}
+
+static void cache_destroy(struct cache_entry * entry)
+{
+	if (entry->I)
+		munmap(entry->I, entry->mapsize);
+	free(entry);
+}
+
+static void cache_path(const struct cache_entry * entry, char * path, size_t size)
+{
+	snprintf(path, size, "%s/%016" PRIx64 "-%" PRId64 ".idx", cache.dir,
+	         entry->digest, entry->sourcesize);
+}
+
+// Unmaps least recently used indexes that are not in use and removes their
+// files, so cache directory does not outgrow the cache. Called locked.
+static void cache_evict(void)
+{
+	struct cache_entry * entry = cache.tail, * prev;
+	char path[1024];
+
+	for (; entry && cache.size > cache.limit; entry = prev)
+	{
+		prev = entry->prev;
+		if (entry->refs || !entry->ready)
+			continue;
+		cache_unlink(entry);
+		cache.size -= (int64_t)entry->mapsize;
+		cache_path(entry, path, sizeof(path));
+		unlink(path);
+		cache_destroy(entry);
+	}
+}
+
+struct cache_file
+{
+	char name[256];
+	time_t mtime;
+	int64_t size;
+};
+
+static int cache_file_compare(const void * a, const void * b)
+{
+	const time_t x = ((const struct cache_file *)a)->mtime, y = ((const struct cache_file *)b)->mtime;
+	return (x < y) - (x > y);
+}
+
+// Removes index files left by previous runs beyond cache size (oldest first)
+// and temporary files of interrupted writes.
+static void cache_trim(void)
+{
+	struct cache_file * files = NULL;
+	size_t count = 0, capacity = 0;
+	int64_t size = 0;
+	struct dirent * d;
+	char path[1024];
+	DIR * dir;
+
+	if ((dir = opendir(cache.dir)) == NULL)
+		errx(1, "opendir (%s)", cache.dir);
+
+	while ((d = readdir(dir)) != NULL)
+	{
+		const size_t length = strlen(d->d_name);
+		struct stat s;
+
+		if (length >= sizeof(files->name) || strstr(d->d_name, ".idx") == NULL)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache.dir, d->d_name);
+		if (strcmp(d->d_name + length - 4, ".idx") != 0)
+		{
+			unlink(path);
+			continue;
+		}
+		if (stat(path, &s) == -1)
+			continue;
+
+		if (count == capacity)
+		{
+			struct cache_file * grown;
+			capacity = capacity ? capacity * 2 : 64;
+			if ((grown = realloc(files, capacity * sizeof(*files))) == NULL)
+				errx(1, "realloc");
+			files = grown;
+		}
+		strcpy(files[count].name, d->d_name);
+		files[count].mtime = s.st_mtime;
+		files[count++].size = s.st_size;
+	}
+	closedir(dir);
+
+	qsort(files, count, sizeof(*files), cache_file_compare);
+	for (size_t i = 0; i < count; ++i)
+	{
+		size += files[i].size;
+		if (size <= cache.limit)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache.dir, files[i].name);
+		unlink(path);
+	}
+	free(files);
+}
+
+// Maps index file, returns 0 on success.
+static int cache_map(const char * path, struct cache_entry * entry)
+{
+	struct stat s;
+	void * map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &s) == -1 || (size_t)s.st_size != entry->mapsize)
+	{
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, entry->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	entry->I = map;
+	return 0;
+}
+
+// Checks that every suffix array entry points into source, so a corrupted or
+// foreign file can never make the search read out of bounds.
+static int cache_validate(const struct cache_entry * entry)
+{
+	const int64_t count = entry->sourcesize + 1;
+
+	for (int64_t i = 0; i < count; ++i)
+		if (entry->I[i] < 0 || entry->I[i] > entry->sourcesize)
+			return -1;
+	return 0;
+}
+
+// Loads index from cache directory or builds and stores it there.
+static int cache_load(const uint8_t * source, struct cache_entry * entry, const char ** state)
+{
+	char path[1024], tmppath[1100];
+	struct bsdiff_index index;
+	struct bsdiff_stream stream;
+	FILE * fp;
+	int result;
+
+	cache_path(entry, path, sizeof(path));
+	if (cache_map(path, entry) == 0)
+	{
+		if (cache_validate(entry) == 0)
+		{
+			*state = "disk";
+			return 0;
+		}
+
+		// Rebuilds invalid index.
+		munmap(entry->I, entry->mapsize);
+		entry->I = NULL;
+		unlink(path);
+	}
+
+	*state = "miss";
+	stream.opaque = NULL;
+	stream.malloc = malloc;
+	stream.free = free;
+	stream.write = NULL;
+	if (bsdiff_index_create(&index, source, entry->sourcesize, &stream))
+		return -1;
+
+	// Writes index under temporary name so other processes never map a partial file.
+	snprintf(tmppath, sizeof(tmppath), "%s.%ld.%p", path, (long)getpid(), (void *)entry);
+	result = -1;
+	if ((fp = fopen(tmppath, "wb")) != NULL)
+	{
+		if (fwrite(index.I, 1, entry->mapsize, fp) == entry->mapsize && fclose(fp) == 0)
+			result = rename(tmppath, path);
+		else
+			fclose(fp);
+		if (result)
+			unlink(tmppath);
+	}
+	bsdiff_index_free(&index, &stream);
+
+	return result ? -1 : cache_map(path, entry);
+}
+
+// Returns index for source (reference held until cache_release) or NULL.
+static struct cache_entry * cache_acquire(const uint8_t * source, int64_t sourcesize,
+                                          uint64_t digest, const char ** state)
+{
+	struct cache_entry * entry;
+
+	pthread_mutex_lock(&cache.mutex);
+	for (entry = cache.head; entry; entry = entry->next)
+		if (entry->digest == digest && entry->sourcesize == sourcesize)
+			break;
+
+	if (entry)
+	{
+		// Another job may still be building this index.
+		*state = entry->ready ? "hit" : "wait";
+		++entry->refs;
+		cache_unlink(entry);
+		cache_push_front(entry);
+		while (!entry->ready && !entry->failed)
+			pthread_cond_wait(&cache.ready, &cache.mutex);
+		if (entry->failed)
+		{
+			if (--entry->refs == 0)
+				cache_destroy(entry);
+			entry = NULL;
+		}
+		pthread_mutex_unlock(&cache.mutex);
+		return entry;
+	}
+
+	if ((entry = calloc(1, sizeof(*entry))) == NULL)
+	{
+		pthread_mutex_unlock(&cache.mutex);
+		return NULL;
+	}
+	entry->digest = digest;
+	entry->sourcesize = sourcesize;
+	entry->mapsize = (size_t)(sourcesize + 1) * sizeof(int64_t);
+	entry->refs = 1;
+	cache_push_front(entry);
+	pthread_mutex_unlock(&cache.mutex);
+
+	// Builds index without holding the lock.
+	const int result = cache_load(source, entry, state);
+
+	pthread_mutex_lock(&cache.mutex);
+	if (result)
+	{
+		entry->failed = 1;
+		cache_unlink(entry);
+		if (--entry->refs == 0)
+			cache_destroy(entry);
+		entry = NULL;
+	}
+	else
+	{
+		entry->ready = 1;
+		cache.size += (int64_t)entry->mapsize;
+		cache_evict();
+	}
+	pthread_cond_broadcast(&cache.ready);
+	pthread_mutex_unlock(&cache.mutex);
+
+	return entry;
+}
+
+static void cache_release(struct cache_entry * entry)
+{
+	pthread_mutex_lock(&cache.mutex);
+	--entry->refs;
+	cache_evict();
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+// Returns whether index for source is cached in memory.
+static int cache_contains(int64_t sourcesize, uint64_t digest)
+{
+	struct cache_entry * entry;
+
+	pthread_mutex_lock(&cache.mutex);
+	for (entry = cache.head; entry; entry = entry->next)
+		if (entry->digest == digest && entry->sourcesize == sourcesize)
+			break;
+	pthread_mutex_unlock(&cache.mutex);
+
+	return entry != NULL;
+}
+
+struct mapped_file
+{
+	uint8_t * data;
+	int64_t size;
+};
+
+// Maps file copy-on-write, so filters can work in place.
+static const char * map_file(const char * path, struct mapped_file * file)
+{
+	static uint8_t empty[1];
+	struct stat s;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return "open";
+	if (fstat(fd, &s) == -1)
+	{
+		close(fd);
+		return "fstat";
+	}
+
+	file->size = s.st_size;
+	file->data = empty;
+	if (file->size > 0)
+	{
+		void * map = mmap(NULL, (size_t)file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			close(fd);
+			return "mmap";
+		}
+		file->data = map;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void unmap_file(struct mapped_file * file)
+{
+	if (file->size > 0)
+		munmap(file->data, (size_t)file->size);
+	file->size = 0;
+}
+
+static const char * run_diff(int argc, char * argv[], const struct timespec * started, struct timings * t)
+{
+	struct mapped_file source = { NULL, 0 }, target = { NULL, 0 };
+	struct bsdiff_header header;
+	struct bsdiff_index index;
+	struct bsdiff_stream stream;
+	struct cache_entry * entry = NULL;
+	const char * err = NULL;
+	int argi = 0, filter, bz2err;
+	int64_t estimate = 0;
+	uint64_t digest;
+	BZFILE * bz2;
+	FILE * fp;
+
+	memset(&header, 0, sizeof(header));
+	if ((err = parse_diff_options(argc, argv, &argi, &header)) != NULL)
+		return err;
+	filter = (int)((header.flags & BSDIFF_HEADER_FILTER_MASK) >> BSDIFF_HEADER_FILTER_SHIFT);
+	if (argc - argi != 3)
+		return "usage: DIFF [-d] [-f x86|arm64] oldfile newfile patchfile";
+
+	if ((err = map_file(argv[argi], &source)) != NULL ||
+	    (err = map_file(argv[argi+1], &target)) != NULL)
+		goto cleanup;
+	bsdiff_filter_encode(source.data, source.size, filter);
+	bsdiff_filter_encode(target.data, target.size, filter);
+
+	// Source digest is the cache key.
+	digest = bsdiff_digest(source.data, source.size);
+
+	// Estimates memory: diff buffer, index construction on miss, filtered copies.
+	estimate = target.size + 1;
+	if (!cache_contains(source.size, digest))
+		estimate += 2 * (source.size + 1) * (int64_t)sizeof(int64_t);
+	if (filter != BSDIFF_FILTER_NONE)
+		estimate += source.size + target.size;
+	budget_acquire(estimate);
+	t->admitted = elapsed(started);
+
+	if ((entry = cache_acquire(source.data, source.size, digest, &t->cache)) == NULL)
+	{
+		err = "index";
+		goto cleanup;
+	}
+	t->index = elapsed(started);
+
+	// Creates patch file.
+	header.targetsize = target.size;
+	header.sourcesize = source.size;
+	header.sourcedigest = digest;
+	if (header.flags & BSDIFF_HEADER_TARGET_DIGEST)
+		header.targetdigest = bsdiff_digest(target.data, target.size);
+	if ((fp = fopen(argv[argi+2], "wb")) == NULL)
+	{
+		err = "fopen";
+		goto cleanup;
+	}
+	if ((err = write_header(fp, &header)) != NULL ||
+	    (bz2 = BZ2_bzWriteOpen(&bz2err, fp, 9, 0, 0)) == NULL)
+	{
+		err = err ? err : "BZ2_bzWriteOpen";
+		fclose(fp);
+		goto cleanup;
+	}
+
+	index.source = source.data;
+	index.sourcesize = source.size;
+	index.I = entry->I;
+	stream.opaque = bz2;
+	stream.malloc = malloc;
+	stream.free = free;
+	stream.write = bz2_write;
+	if (bsdiff_indexed(&index, target.data, target.size, &stream))
+		err = "bsdiff";
+
+	BZ2_bzWriteClose(&bz2err, bz2, 0, NULL, NULL);
+	if (bz2err != BZ_OK && err == NULL)
+		err = "BZ2_bzWriteClose";
+	if (fclose(fp) != 0 && err == NULL)
+		err = "fclose";
+
+cleanup:
+	if (entry)
+		cache_release(entry);
+	if (estimate)
+		budget_release(estimate);
+	unmap_file(&source);
+	unmap_file(&target);
+	return err;
+}
+
+static const char * run_patch(int argc, char * argv[], const struct timespec * started, struct timings * t)
+{
+	struct mapped_file source = { NULL, 0 };
+	struct bsdiff_header header;
+	struct bspatch_stream stream;
+	const char * err = NULL;
+	int filter, bz2err;
+	int64_t estimate = 0;
+	uint64_t digest;
+	uint8_t * target = NULL;
+	BZFILE * bz2 = NULL;
+	FILE * fp;
+
+	if (argc != 3)
+		return "usage: PATCH oldfile newfile patchfile";
+
+	if ((fp = fopen(argv[2], "rb")) == NULL)
+		return "fopen";
+	if ((err = read_header(fp, &header)) != NULL)
+		goto cleanup;
+	if (header.flags & BSDIFF_HEADER_REFERENCES_MASK)
+	{
+		err = "several old files";
+		goto cleanup;
+	}
+
+	if ((err = map_file(argv[0], &source)) != NULL)
+		goto cleanup;
+	filter = (int)((header.flags & BSDIFF_HEADER_FILTER_MASK) >> BSDIFF_HEADER_FILTER_SHIFT);
+	if (bsdiff_filter_encode(source.data, source.size, filter))
+	{
+		err = "unsupported filter";
+		goto cleanup;
+	}
+
+	// Verifies source before admitting the job.
+	if ((header.flags & BSDIFF_HEADER_SOURCE_DIGEST) &&
+	    (source.size != header.sourcesize || bsdiff_digest(source.data, source.size) != header.sourcedigest))
+	{
+		err = "source digest mismatch";
+		goto cleanup;
+	}
+
+	estimate = header.targetsize + 1;
+	if (filter != BSDIFF_FILTER_NONE)
+		estimate += source.size;
+	budget_acquire(estimate);
+	t->admitted = t->index = elapsed(started);
+
+	if ((target = malloc(header.targetsize + 1)) == NULL)
+	{
+		err = "malloc";
+		goto cleanup;
+	}
+	if ((bz2 = BZ2_bzReadOpen(&bz2err, fp, 0, 0, NULL, 0)) == NULL)
+	{
+		err = "BZ2_bzReadOpen";
+		goto cleanup;
+	}
+
+	stream.opaque = bz2;
+	stream.read = bz2_read;
+	if (bspatch_multi((const uint8_t * const *)&source.data, &source.size, 1, target, header.targetsize,
+	                  &stream, (header.flags & BSDIFF_HEADER_TARGET_DIGEST) ? &digest : NULL))
+		err = "bspatch";
+	else if ((header.flags & BSDIFF_HEADER_TARGET_DIGEST) && digest != header.targetdigest)
+		err = "target digest mismatch";
+	else
+	{
+		FILE * out;
+		bsdiff_filter_decode(target, header.targetsize, filter);
+		if ((out = fopen(argv[1], "wb")) == NULL)
+			err = "fopen";
+		else
+		{
+			if (fwrite(target, 1, (size_t)header.targetsize, out) != (size_t)header.targetsize)
+				err = "fwrite";
+			if (fclose(out) != 0 && err == NULL)
+				err = "fclose";
+		}
+	}
+
+cleanup:
+	if (bz2)
+		BZ2_bzReadClose(&bz2err, bz2);
+	fclose(fp);
+	free(target);
+	if (estimate)
+		budget_release(estimate);
+	unmap_file(&source);
+	return err;
+}
+
+// Sends response, logs it and closes connection.
+static void respond(int fd, uint64_t id, const char * response)
+{
+	fprintf(stderr, "bsdiffd: %s", response);
+	if (send(fd, response, strlen(response), 0) < 0)
+		fprintf(stderr, "bsdiffd: send (job %" PRIu64 ")\n", id);
+	close(fd);
+}
+
+static void respond_error(int fd, uint64_t id, const char * err)
+{
+	char response[BSDIFFD_LINE_SIZE];
+
+	snprintf(response, sizeof(response), "ERR %" PRIu64 " %s\n", id, err);
+	respond(fd, id, response);
+}
+
+static void process(struct job * job)
+{
+	char response[BSDIFFD_LINE_SIZE];
+	char * argv[BSDIFFD_MAX_ARGS] = { NULL };
+	const char * err;
+	struct timespec started;
+	struct timings t = { 0, 0, 0, 0, 0, "none" };
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	t.queued = elapsed(&job->received);
+
+	for (int i = 0; i < job->argc; ++i)
+		argv[i] = job->line + job->args[i];
+
+	// Parsed jobs always have a command (see parse).
+	if (job->argc < 1)
+		err = "unknown command";
+	else if (strcmp(argv[0], "DIFF") == 0)
+		err = run_diff(job->argc - 1, argv + 1, &started, &t);
+	else
+		err = run_patch(job->argc - 1, argv + 1, &started, &t);
+
+	// Run covers only the work after index was ready.
+	t.run = elapsed(&started) - t.index;
+	t.total = elapsed(&job->accepted);
+
+	// Reports timings in milliseconds: waiting in queue, reading inputs and
+	// waiting for memory budget, getting source index, diffing or patching
+	// and the whole job.
+	if (err)
+	{
+		respond_error(job->fd, job->id, err);
+		return;
+	}
+
+	snprintf(response, sizeof(response),
+	         "OK %" PRIu64 " queued=%.1f admit=%.1f index=%.1f run=%.1f total=%.1f cache=%s\n",
+	         job->id, t.queued, t.admitted, t.index - t.admitted, t.run, t.total, t.cache);
+	respond(job->fd, job->id, response);
+}
+
+static void * worker(ATTR_UNUSED void * arg)
+{
+	// Jobs carry the whole request line, so they are kept off the stack.
+	struct job * current = malloc(sizeof(*current));
+
+	if (current == NULL)
+		errx(1, "malloc");
+
+	for (;;)
+	{
+		pthread_mutex_lock(&queue.mutex);
+		while (queue.count == 0)
+			pthread_cond_wait(&queue.notempty, &queue.mutex);
+		*current = queue.jobs[queue.head];
+		queue.head = (queue.head + 1) % BSDIFFD_QUEUE_SIZE;
+		--queue.count;
+		pthread_cond_signal(&queue.notfull);
+		pthread_mutex_unlock(&queue.mutex);
+
+		process(current);
+	}
+
+	return NULL;
+}
+
+// Reads available part of request line. Returns 1 when the whole line was
+// read, 0 when more data is expected and -1 when connection should be closed.
+static int connection_read(struct connection * c)
+{
+	const size_t capacity = sizeof(c->job.line) - 1;
+	ssize_t n;
+	char * end;
+
+	n = recv(c->job.fd, c->job.line + c->length, capacity - c->length, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return -1;
+
+	c->job.line[c->length + (size_t)n] = '\0';
+	end = strchr(c->job.line + c->length, '\n');
+	c->length += (size_t)n;
+	if (end == NULL)
+	{
+		if (c->length < capacity)
+			return 0;
+		respond_error(c->job.fd, c->job.id, "request too long");
+		return -1;
+	}
+
+	*end = '\0';
+	if (end > c->job.line && end[-1] == '\r')
+		end[-1] = '\0';
+	return 1;
+}
+
+// Tokenizes request line, returns NULL or error.
+static const char * parse(struct job * job)
+{
+	char * saveptr;
+
+	job->argc = 0;
+	for (char * token = strtok_r(job->line, " \t", &saveptr); token;
+	     token = strtok_r(NULL, " \t", &saveptr))
+	{
+		if (job->argc == BSDIFFD_MAX_ARGS)
+			return "too many arguments";
+		job->args[job->argc++] = (size_t)(token - job->line);
+	}
+
+	if (job->argc == 0 ||
+	    (strcmp(job->line + job->args[0], "DIFF") != 0 && strcmp(job->line + job->args[0], "PATCH") != 0))
+		return "unknown command";
+	return NULL;
+}
+
+// Passes parsed job to the pool. The socket is made blocking again, but with
+// send timeout, so a worker never waits for the client.
+static void enqueue(struct job * job)
+{
+	const struct timeval timeout = { BSDIFFD_TIMEOUT / 1000, 0 };
+	const char * err;
+
+	clock_gettime(CLOCK_MONOTONIC, &job->received);
+	if ((err = parse(job)) != NULL)
+	{
+		respond_error(job->fd, job->id, err);
+		return;
+	}
+
+	fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(job->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	pthread_mutex_lock(&queue.mutex);
+	while (queue.count == BSDIFFD_QUEUE_SIZE)
+		pthread_cond_wait(&queue.notfull, &queue.mutex);
+	queue.jobs[(queue.head + queue.count) % BSDIFFD_QUEUE_SIZE] = *job;
+	++queue.count;
+	pthread_cond_signal(&queue.notempty);
+	pthread_mutex_unlock(&queue.mutex);
+}
+
+// Accepts connections and reads their request lines without blocking, so
+// clients that stay silent never occupy a worker. Connections without
+// a complete line after timeout are closed.
+static void serve(int listener)
+{
+	struct connection * pending = malloc(BSDIFFD_MAX_PENDING * sizeof(*pending));
+	struct pollfd fds[BSDIFFD_MAX_PENDING + 1];
+	int count = 0;
+	uint64_t id = 0;
+
+	if (pending == NULL)
+		errx(1, "malloc");
+
+	for (;;)
+	{
+		const int polled = count;
+
+		// Stops accepting while too many connections are being read.
+		fds[0].fd = listener;
+		fds[0].events = count < BSDIFFD_MAX_PENDING ? POLLIN : 0;
+		for (int i = 0; i < count; ++i)
+		{
+			fds[1+i].fd = pending[i].job.fd;
+			fds[1+i].events = POLLIN;
+		}
+
+		if (poll(fds, (nfds_t)count + 1, 250) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			errx(1, "poll");
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			struct connection * c = pending + count;
+
+			if ((c->job.fd = accept(listener, NULL, NULL)) == -1)
+			{
+				if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EMFILE)
+					errx(1, "accept");
+			}
+			else
+			{
+				fcntl(c->job.fd, F_SETFL, fcntl(c->job.fd, F_GETFL) | O_NONBLOCK);
+				c->job.id = ++id;
+				clock_gettime(CLOCK_MONOTONIC, &c->job.accepted);
+				c->length = 0;
+				++count;
+			}
+		}
+
+		// Goes backwards, so the last connection can replace a finished one.
+		for (int i = polled - 1; i >= 0; --i)
+		{
+			struct connection * c = pending + i;
+			int result = 0;
+
+			if (fds[1+i].revents)
+				result = connection_read(c);
+			if (result == 0 && elapsed(&c->job.accepted) > BSDIFFD_TIMEOUT)
+			{
+				respond_error(c->job.fd, c->job.id, "timeout");
+				result = -1;
+			}
+
+			if (result == 1)
+				enqueue(&c->job);
+			else if (result < 0)
+				close(c->job.fd);
+			if (result != 0)
+				pending[i] = pending[--count];
+		}
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	struct sockaddr_un address;
+	int argi = 1, listener;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const int64_t memory = (int64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+	// Defaults to half of physical memory for jobs and quarter for indexes.
+	budget.limit = memory / 2;
+	cache.limit = memory / 4;
+
+	for (; argi + 1 < argc && argv[argi][0] == '-'; argi += 2)
+	{
+		if (strcmp(argv[argi], "-j") == 0)
+			threads = atol(argv[argi+1]);
+		else if (strcmp(argv[argi], "-m") == 0)
+			budget.limit = atoll(argv[argi+1]) * 1048576;
+		else if (strcmp(argv[argi], "-c") == 0)
+			cache.limit = atoll(argv[argi+1]) * 1048576;
+		else
+			break;
+	}
+
+	if (argc - argi != 2 || threads < 1)
+		errx(1, "usage: %s [-j threads] [-m budget_mb] [-c cache_mb] cachedir socketpath\n", argv[0]);
+	cache.dir = argv[argi];
+	cache_trim();
+
+	// Clients may disconnect before reading the response.
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(argv[argi+1]) >= sizeof(address.sun_path))
+		errx(1, "Socket path too long (%s)", argv[argi+1]);
+	strcpy(address.sun_path, argv[argi+1]);
+
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		errx(1, "socket");
+	unlink(address.sun_path);
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1)
+		errx(1, "bind (%s)", address.sun_path);
+	if (listen(listener, 128) == -1)
+		errx(1, "listen (%s)", address.sun_path);
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+	for (long i = 0; i < threads; ++i)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, NULL) != 0)
+			errx(1, "pthread_create");
+		pthread_detach(thread);
+	}
+
+	fprintf(stderr, "bsdiffd: listening on %s (%ld threads, budget %" PRId64 " MB, cache %" PRId64 " MB)\n",
+	        address.sun_path, threads, budget.limit / 1048576, cache.limit / 1048576);
+
+	serve(listener);
+	return 0;
+}
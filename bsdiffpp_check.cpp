@@ -0,0 +1,105 @@
+/*-
+ * Copyright 2018-2020 Emanuel Komínek
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Instantiates bsdiff.hpp and round-trips a file through it:
+//   bsdiffpp_check oldfile newfile
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "bsdiff.hpp"
+
+static std::vector<std::uint8_t> read_file(const char * path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw bsdiffpp::error(path);
+	return { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc != 3)
+	{
+		std::fprintf(stderr, "usage: %s oldfile newfile\n", argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		const std::vector<std::uint8_t> source = read_file(argv[1]), target = read_file(argv[2]);
+		const std::uint64_t digest = bsdiff_digest(target.data(), static_cast<std::int64_t>(target.size()));
+		std::vector<std::uint8_t> patch, output(target.size());
+
+		// Creates patch through an index owned by a pmr arena.
+		std::pmr::monotonic_buffer_resource arena;
+		bsdiffpp::index index(source, &arena);
+		bsdiffpp::diff(index, target, [&](std::span<const std::uint8_t> data, bsdiff_stream_type) {
+			patch.insert(patch.end(), data.begin(), data.end());
+			return true;
+		});
+
+		// Applies it with pull-based reader.
+		std::size_t offset = 0;
+		if (bsdiffpp::patch(source, output, [&](std::span<std::uint8_t> data, bspatch_stream_type) {
+			if (data.size() > patch.size() - offset)
+				return false;
+			std::copy_n(patch.begin() + static_cast<std::ptrdiff_t>(offset), data.size(), data.begin());
+			offset += data.size();
+			return true;
+		}) != digest || output != target)
+			throw bsdiffpp::error("patch");
+
+		// Applies it with push-based patcher, in two pieces.
+		std::fill(output.begin(), output.end(), 0);
+		bsdiffpp::patcher patcher(source, output, true);
+		patcher.feed(std::span(patch).first(patch.size() / 2));
+		patcher.feed(std::span(patch).subspan(patch.size() / 2));
+		if (patcher.finish() != digest || output != target)
+			throw bsdiffpp::error("patcher");
+
+		// Checks that exceptions of callbacks reach the caller.
+		try
+		{
+			bsdiffpp::diff(source, target, [](std::span<const std::uint8_t>, bsdiff_stream_type) -> bool {
+				throw std::out_of_range("sink");
+			});
+			throw bsdiffpp::error("exception");
+		}
+		catch (const std::out_of_range &)
+		{
+		}
+	}
+	catch (const std::exception & e)
+	{
+		std::fprintf(stderr, "bsdiffpp_check: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -26,8 +26,170 @@
  */
 
 #include <limits.h>
+#include <stdint.h>
+#include <string.h>
 #include "bspatch.h"
 
+#ifndef min
+# define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+// Streaming XXH64 (seed 0) used for source and target digests.
+
+#define BSDIFF_DIGEST_PRIME1 UINT64_C(0x9E3779B185EBCA87)
+#define BSDIFF_DIGEST_PRIME2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define BSDIFF_DIGEST_PRIME3 UINT64_C(0x165667B19E3779F9)
+#define BSDIFF_DIGEST_PRIME4 UINT64_C(0x85EBCA77C2B2AE63)
+#define BSDIFF_DIGEST_PRIME5 UINT64_C(0x27D4EB2F165667C5)
+
+static inline uint64_t bsdiff_digest_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t bsdiff_digest_read64(const uint8_t * p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+	       (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t bsdiff_digest_read32(const uint8_t * p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+	       (uint64_t)p[3] << 24;
+}
+
+static inline uint64_t bsdiff_digest_round(uint64_t acc, uint64_t input)
+{
+	acc += input * BSDIFF_DIGEST_PRIME2;
+	acc = bsdiff_digest_rotl(acc, 31);
+	return acc * BSDIFF_DIGEST_PRIME1;
+}
+
+static inline uint64_t bsdiff_digest_merge(uint64_t h, uint64_t acc)
+{
+	h ^= bsdiff_digest_round(0, acc);
+	return h * BSDIFF_DIGEST_PRIME1 + BSDIFF_DIGEST_PRIME4;
+}
+
+void bsdiff_digest_init(struct bsdiff_digest_state * state)
+{
+	state->acc[0] = BSDIFF_DIGEST_PRIME1 + BSDIFF_DIGEST_PRIME2;
+	state->acc[1] = BSDIFF_DIGEST_PRIME2;
+	state->acc[2] = 0;
+	state->acc[3] = (uint64_t)0 - BSDIFF_DIGEST_PRIME1;
+	state->total = 0;
+	state->buffered = 0;
+}
+
+// Consumes 32-byte stripes and returns number of bytes consumed.
+static inline size_t bsdiff_digest_stripes(uint64_t * acc, const uint8_t * p, size_t size)
+{
+	uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+	size_t i;
+
+	for (i = 0; i + 32 <= size; i += 32)
+	{
+		a0 = bsdiff_digest_round(a0, bsdiff_digest_read64(p + i));
+		a1 = bsdiff_digest_round(a1, bsdiff_digest_read64(p + i + 8));
+		a2 = bsdiff_digest_round(a2, bsdiff_digest_read64(p + i + 16));
+		a3 = bsdiff_digest_round(a3, bsdiff_digest_read64(p + i + 24));
+	}
+
+	acc[0] = a0; acc[1] = a1; acc[2] = a2; acc[3] = a3;
+	return i;
+}
+
+void bsdiff_digest_update(struct bsdiff_digest_state * state, const void * buffer, size_t size)
+{
+	const uint8_t * p = (const uint8_t *)buffer;
+	size_t consumed;
+
+	state->total += size;
+
+	// Completes previously buffered stripe.
+	if (state->buffered != 0)
+	{
+		const size_t fill = (32 - state->buffered < size) ? 32 - state->buffered : size;
+		memcpy(state->buffer + state->buffered, p, fill);
+		state->buffered += fill;
+		p += fill;
+		size -= fill;
+		if (state->buffered < 32)
+			return;
+		bsdiff_digest_stripes(state->acc, state->buffer, 32);
+		state->buffered = 0;
+	}
+
+	consumed = bsdiff_digest_stripes(state->acc, p, size);
+
+	// Keeps the tail for the next update.
+	memcpy(state->buffer, p + consumed, size - consumed);
+	state->buffered = size - consumed;
+}
+
+uint64_t bsdiff_digest_final(const struct bsdiff_digest_state * state)
+{
+	const uint8_t * p = state->buffer;
+	size_t size = state->buffered;
+	uint64_t h;
+
+	if (state->total >= 32)
+	{
+		h = bsdiff_digest_rotl(state->acc[0], 1) + bsdiff_digest_rotl(state->acc[1], 7) +
+		    bsdiff_digest_rotl(state->acc[2], 12) + bsdiff_digest_rotl(state->acc[3], 18);
+		for (int i = 0; i < 4; ++i)
+			h = bsdiff_digest_merge(h, state->acc[i]);
+	}
+	else
+		h = BSDIFF_DIGEST_PRIME5;
+
+	h += state->total;
+
+	for (; size >= 8; p += 8, size -= 8)
+	{
+		h ^= bsdiff_digest_round(0, bsdiff_digest_read64(p));
+		h = bsdiff_digest_rotl(h, 27) * BSDIFF_DIGEST_PRIME1 + BSDIFF_DIGEST_PRIME4;
+	}
+	if (size >= 4)
+	{
+		h ^= bsdiff_digest_read32(p) * BSDIFF_DIGEST_PRIME1;
+		h = bsdiff_digest_rotl(h, 23) * BSDIFF_DIGEST_PRIME2 + BSDIFF_DIGEST_PRIME3;
+		p += 4;
+		size -= 4;
+	}
+	for (; size > 0; ++p, --size)
+	{
+		h ^= *p * BSDIFF_DIGEST_PRIME5;
+		h = bsdiff_digest_rotl(h, 11) * BSDIFF_DIGEST_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= BSDIFF_DIGEST_PRIME2;
+	h ^= h >> 29;
+	h *= BSDIFF_DIGEST_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t bsdiff_digest(const uint8_t * buffer, int64_t size)
+{
+	struct bsdiff_digest_state state;
+	bsdiff_digest_init(&state);
+	while (size > 0)
+	{
+		const size_t chunk = (size_t)((size < 1073741824) ? size : 1073741824);
+		bsdiff_digest_update(&state, buffer, chunk);
+		buffer += chunk;
+		size -= chunk;
+	}
+	return bsdiff_digest_final(&state);
+}
+
+// Diff and extra blocks are processed in slabs of this size.
+#define BSPATCH_SLAB_SIZE 65536
+
 // Converts signed magnitude to two's complement.
 static inline void offtin(int64_t * x)
 {
@@ -35,12 +197,45 @@ static inline void offtin(int64_t * x)
 		*x = (~*x + 1) | INT64_MIN;
 }
 
-int bspatch(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
-            const int64_t targetsize, struct bspatch_stream * stream)
+// Adds source data to target. Position is an offset into concatenation of
+// all references, so a single block may span several of them.
+static inline void bspatch_add(const uint8_t * const * sources, const int64_t * sourcesizes,
+                               uint8_t * target, int64_t oldpos, int64_t length)
 {
-	int64_t oldpos = 0, newpos = 0;
+	for (int r = 0; length > 0; ++r)
+	{
+		if (oldpos >= sourcesizes[r])
+		{
+			oldpos -= sourcesizes[r];
+			continue;
+		}
+
+		const uint8_t * source = sources[r] + oldpos;
+		const int64_t len = min(length, sourcesizes[r] - oldpos);
+		for (int64_t i = 0; i < len; ++i)
+			target[i] += source[i];
+
+		target += len;
+		length -= len;
+		oldpos = 0;
+	}
+}
+
+static int bspatch_internal(const uint8_t * const * sources, const int64_t * sourcesizes,
+                            int sourcecount, uint8_t * target, const int64_t targetsize,
+                            struct bspatch_stream * stream,
+                            struct bsdiff_digest_state * digest)
+{
+	int64_t oldpos = 0, newpos = 0, sourcesize = 0;
 	int64_t ctrl[3];
 
+	for (int r = 0; r < sourcecount; ++r)
+	{
+		if (sourcesizes[r] < 0)
+			return -1;
+		sourcesize += sourcesizes[r];
+	}
+
 	while (newpos < targetsize)
 	{
 		// Reads control data block.
@@ -52,16 +247,20 @@ int bspatch(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
 		// Checks sanity of diff control data.
 		if (ctrl[0] < 0 || ctrl[0] > targetsize - newpos)
 			return -1;
-
-		// Reads diff data block.
-		if (stream->read(stream, target + newpos, ctrl[0], BSDIFF_READDIFF))
-			return -1;
-
-		// Adds old data to the diff data.
 		if (oldpos < 0 || oldpos + ctrl[0] < 0 || oldpos + ctrl[0] > sourcesize)
 			return -1;
-		for(int64_t i = 0; i < ctrl[0]; ++i)
-			target[newpos+i] += source[oldpos+i];
+
+		// Reads diff data block and adds old data to it slab by slab, so the
+		// digest sees each slab while it is still in cache.
+		for (int64_t done = 0, len; done < ctrl[0]; done += len)
+		{
+			len = min(ctrl[0] - done, BSPATCH_SLAB_SIZE);
+			if (stream->read(stream, target + newpos + done, (size_t)len, BSDIFF_READDIFF))
+				return -1;
+			bspatch_add(sources, sourcesizes, target + newpos + done, oldpos + done, len);
+			if (digest)
+				bsdiff_digest_update(digest, target + newpos + done, (size_t)len);
+		}
 
 		// Adjusts position pointers.
 		newpos += ctrl[0];
@@ -72,8 +271,14 @@ int bspatch(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
 			return -1;
 
 		// Reads extra data block.
-		if (stream->read(stream, target + newpos, ctrl[1], BSDIFF_READEXTRA))
-			return -1;
+		for (int64_t done = 0, len; done < ctrl[1]; done += len)
+		{
+			len = min(ctrl[1] - done, BSPATCH_SLAB_SIZE);
+			if (stream->read(stream, target + newpos + done, (size_t)len, BSDIFF_READEXTRA))
+				return -1;
+			if (digest)
+				bsdiff_digest_update(digest, target + newpos + done, (size_t)len);
+		}
 
 		// Adjust position pointers.
 		newpos+=ctrl[1];
@@ -83,91 +288,393 @@ int bspatch(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
 	return 0;
 }
 
-#if defined(BSPATCH_EXECUTABLE)
+int bspatch(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
+            const int64_t targetsize, struct bspatch_stream * stream)
+{
+	return bspatch_internal(&source, &sourcesize, 1, target, targetsize, stream, NULL);
+}
 
-#include <bzlib.h>
-#include <string.h>
-#include "bsdiff_common.h"
+int bspatch_digest(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
+                   const int64_t targetsize, struct bspatch_stream * stream,
+                   uint64_t * digest)
+{
+	struct bsdiff_digest_state state;
 
-static int bz2_read(const struct bspatch_stream * stream, void * buffer,
-                    size_t length, ATTR_UNUSED enum bspatch_stream_type type)
+	bsdiff_digest_init(&state);
+	if (bspatch_internal(&source, &sourcesize, 1, target, targetsize, stream, &state))
+		return -1;
+
+	*digest = bsdiff_digest_final(&state);
+	return 0;
+}
+
+int bspatch_multi(const uint8_t * const * sources, const int64_t * sourcesizes, int sourcecount,
+                  uint8_t * target, const int64_t targetsize, struct bspatch_stream * stream,
+                  uint64_t * digest)
+{
+	struct bsdiff_digest_state state;
+
+	bsdiff_digest_init(&state);
+	if (bspatch_internal(sources, sourcesizes, sourcecount, target, targetsize, stream,
+	                     digest ? &state : NULL))
+		return -1;
+
+	if (digest)
+		*digest = bsdiff_digest_final(&state);
+	return 0;
+}
+
+int bspatch_begin(struct bspatch_state * state, const uint8_t * source,
+                  const int64_t sourcesize, uint8_t * target, const int64_t targetsize,
+                  int digest)
 {
-	size_t bytes_read = 0;
-	int to_read;
-	while ((to_read = (int)min(length - bytes_read, 1048576)) != 0)
+	if (sourcesize < 0 || targetsize < 0)
+		return -1;
+
+	state->source = source;
+	state->sourcesize = sourcesize;
+	state->target = target;
+	state->targetsize = targetsize;
+	state->oldpos = 0;
+	state->newpos = 0;
+	state->ctrl[0] = state->ctrl[1] = state->ctrl[2] = 0;
+	state->remaining = 0;
+	state->phase = BSDIFF_READCONTROL;
+	state->ctrlsize = 0;
+	state->digesting = digest != 0;
+	state->failed = 0;
+	bsdiff_digest_init(&state->digest);
+
+	return 0;
+}
+
+// Moves past finished (possibly empty) diff and extra blocks.
+static int bspatch_advance(struct bspatch_state * state)
+{
+	if (state->phase == BSDIFF_READDIFF && state->remaining == 0)
 	{
-		int bz2err;
-		if (BZ2_bzRead(&bz2err, (BZFILE *)stream->opaque, (uint8_t *)buffer + bytes_read, to_read) != to_read)
+		// Checks sanity of extra control data.
+		if (state->ctrl[1] < 0 || state->ctrl[1] > state->targetsize - state->newpos)
 			return -1;
-		bytes_read += to_read;
+		state->phase = BSDIFF_READEXTRA;
+		state->remaining = state->ctrl[1];
+	}
+
+	if (state->phase == BSDIFF_READEXTRA && state->remaining == 0)
+	{
+		state->oldpos += state->ctrl[2];
+		state->phase = BSDIFF_READCONTROL;
 	}
 
 	return 0;
 }
 
+static int bspatch_consume(struct bspatch_state * state, const void * buffer, size_t size)
+{
+	const uint8_t * data = (const uint8_t *)buffer;
+
+	while (size > 0)
+	{
+		if (state->phase == BSDIFF_READCONTROL)
+		{
+			// Data past the end of patch.
+			if (state->newpos >= state->targetsize)
+				return -1;
+
+			// Buffers control data block which may arrive in pieces.
+			const size_t len = min(sizeof(state->ctrlbuffer) - state->ctrlsize, size);
+			memcpy(state->ctrlbuffer + state->ctrlsize, data, len);
+			state->ctrlsize += len;
+			data += len;
+			size -= len;
+			if (state->ctrlsize < sizeof(state->ctrlbuffer))
+				break;
+
+			memcpy(state->ctrl, state->ctrlbuffer, sizeof(state->ctrl));
+			for (int i = 0; i <= 2; ++i)
+				offtin(state->ctrl + i);
+			state->ctrlsize = 0;
+
+			// Checks sanity of diff control data.
+			if (state->ctrl[0] < 0 || state->ctrl[0] > state->targetsize - state->newpos)
+				return -1;
+			if (state->oldpos < 0 || state->oldpos + state->ctrl[0] < 0 ||
+			    state->oldpos + state->ctrl[0] > state->sourcesize)
+				return -1;
+
+			state->phase = BSDIFF_READDIFF;
+			state->remaining = state->ctrl[0];
+		}
+		else
+		{
+			const int64_t len = min(state->remaining, (int64_t)min(size, (size_t)INT64_MAX));
+			uint8_t * out = state->target + state->newpos;
+
+			if (state->phase == BSDIFF_READDIFF)
+			{
+				const uint8_t * old = state->source + state->oldpos;
+				for (int64_t i = 0; i < len; ++i)
+					out[i] = data[i] + old[i];
+				state->oldpos += len;
+			}
+			else
+				memcpy(out, data, (size_t)len);
+
+			if (state->digesting)
+				bsdiff_digest_update(&state->digest, out, (size_t)len);
+			state->newpos += len;
+			state->remaining -= len;
+			data += len;
+			size -= (size_t)len;
+		}
+
+		if (bspatch_advance(state))
+			return -1;
+	}
+
+	return 0;
+}
+
+int bspatch_feed(struct bspatch_state * state, const void * buffer, size_t size)
+{
+	// Position in patch is unknown after error so it sticks.
+	if (state->failed || bspatch_consume(state, buffer, size))
+	{
+		state->failed = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int bspatch_finish(struct bspatch_state * state, uint64_t * digest)
+{
+	if (state->failed)
+		return -1;
+
+	// Patch is complete only when whole target was produced.
+	if (state->phase != BSDIFF_READCONTROL || state->ctrlsize != 0 ||
+	    state->newpos != state->targetsize)
+		return -1;
+
+	// Digest was not requested in bspatch_begin.
+	if (digest && !state->digesting)
+		return -1;
+
+	if (digest)
+		*digest = bsdiff_digest_final(&state->digest);
+	return 0;
+}
+
+int bspatch_view(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
+                 const int64_t targetsize, struct bspatch_view_stream * stream,
+                 uint64_t * digest)
+{
+	struct bspatch_state state;
+
+	if (bspatch_begin(&state, source, sourcesize, target, targetsize, digest != NULL))
+		return -1;
+
+	// Feeds viewed data straight from reader's buffer.
+	while (state.newpos < targetsize || state.phase != BSDIFF_READCONTROL)
+	{
+		const void * buffer;
+		size_t length = state.phase == BSDIFF_READCONTROL ?
+			sizeof(state.ctrlbuffer) - state.ctrlsize :
+			(size_t)min(state.remaining, (int64_t)(SIZE_MAX >> 1));
+
+		if (stream->view(stream, &buffer, &length, state.phase) || length == 0)
+			return -1;
+		if (bspatch_feed(&state, buffer, length))
+			return -1;
+	}
+
+	return bspatch_finish(&state, digest);
+}
+
+#if defined(BSPATCH_EXECUTABLE)
+
+#include "bsdiff_common.h"
+#include "bspatch_compose.h"
+
+// Opens patch file, reads its header and opens bzip2 stream.
+static BZFILE * open_patch(const char * path, FILE ** fp, struct bsdiff_header * header)
+{
+	BZFILE * bz2;
+	int bz2err;
+	const char * err;
+
+	if ((*fp = fopen(path, "rb")) == NULL)
+		errx(1, "fopen (%s)\n", path);
+	if ((err = read_header(*fp, header)) != NULL)
+		errx(1, "%s (%s)\n", err, path);
+	if ((bz2 = BZ2_bzReadOpen(&bz2err, *fp, 0, 0, NULL, 0)) == NULL)
+		errx(1, "BZ2_bzReadOpen (bz2err: %d)", bz2err);
+
+	return bz2;
+}
+
+static void close_patch(const char * path, FILE * fp, BZFILE * bz2)
+{
+	int bz2err;
+
+	BZ2_bzReadClose(&bz2err, bz2);
+	if (bz2err != BZ_OK)
+		errx(1, "BZ2_bzReadClose (bz2err: %d)", bz2err);
+	if (fclose(fp) != 0)
+		errx(1, "fclose (%s)", path);
+}
+
+// Composes two chained patches into one without touching any of the files.
+static int compose(const char * firstpath, const char * secondpath, const char * outputpath)
+{
+	FILE * firstfp, * secondfp, * fp;
+	BZFILE * first, * second, * bz2;
+	int bz2err;
+	const char * err;
+	struct bsdiff_header firstheader, secondheader, header;
+	struct bspatch_stream firststream, secondstream;
+	struct bsdiff_stream stream;
+
+	first = open_patch(firstpath, &firstfp, &firstheader);
+	second = open_patch(secondpath, &secondfp, &secondheader);
+
+	// Checks that the second patch applies to output of the first one.
+	if ((firstheader.flags & BSDIFF_HEADER_FILTER_MASK) != (secondheader.flags & BSDIFF_HEADER_FILTER_MASK))
+		errx(1, "Patches use different filters (%s, %s)\n", firstpath, secondpath);
+	if (secondheader.flags & BSDIFF_HEADER_REFERENCES_MASK)
+		errx(1, "Patch uses several old files (%s)\n", secondpath);
+	if ((secondheader.flags & BSDIFF_HEADER_SOURCE_DIGEST) &&
+	    (secondheader.sourcesize != firstheader.targetsize ||
+	     ((firstheader.flags & BSDIFF_HEADER_TARGET_DIGEST) &&
+	      secondheader.sourcedigest != firstheader.targetdigest)))
+		errx(1, "Patches do not chain (%s, %s)\n", firstpath, secondpath);
+
+	// Takes source information from the first patch and target from the second.
+	memset(&header, 0, sizeof(header));
+	header.targetsize = secondheader.targetsize;
+	header.flags = (firstheader.flags & (BSDIFF_HEADER_SOURCE_DIGEST | BSDIFF_HEADER_FILTER_MASK |
+	                                     BSDIFF_HEADER_REFERENCES_MASK)) |
+	               (secondheader.flags & BSDIFF_HEADER_TARGET_DIGEST);
+	header.sourcesize = firstheader.sourcesize;
+	header.sourcedigest = firstheader.sourcedigest;
+	header.targetdigest = secondheader.targetdigest;
+
+	// Creates patch file.
+	if ((fp = fopen(outputpath, "wb")) == NULL)
+		errx(1, "fopen (%s)", outputpath);
+	if ((err = write_header(fp, &header)) != NULL)
+		errx(1, "%s (%s)", err, outputpath);
+	if ((bz2 = BZ2_bzWriteOpen(&bz2err, fp, 9, 0, 0)) == NULL)
+		errx(1, "BZ2_bzWriteOpen (bz2err=%d)", bz2err);
+
+	// Composes patches.
+	firststream.read = bz2_read;
+	firststream.opaque = first;
+	secondstream.read = bz2_read;
+	secondstream.opaque = second;
+	stream.opaque = bz2;
+	stream.malloc = malloc;
+	stream.free = free;
+	stream.write = bz2_write;
+	if (bspatch_compose(&firststream, firstheader.targetsize, &secondstream,
+	                    secondheader.targetsize, &stream))
+		errx(1, "bspatch_compose");
+
+	// Closes patch files.
+	close_patch(firstpath, firstfp, first);
+	close_patch(secondpath, secondfp, second);
+	BZ2_bzWriteClose(&bz2err, bz2, 0, NULL, NULL);
+	if (bz2err != BZ_OK)
+		errx(1, "BZ2_bzWriteClose (bz2err=%d)", bz2err);
+	if (fclose(fp) != 0)
+		errx(1, "fclose (%s)", outputpath);
+
+	return 0;
+}
+
 int main(int argc, char * argv[])
 {
 	FILE * fp;
 	BZFILE * bz2;
-	int bz2err;
-	uint8_t header[24];
-	uint8_t * source, * target;
-	int64_t sourcesize, targetsize;
+	struct bsdiff_header header;
+	int filter, sourcecount;
+	uint8_t ** sources, * target;
+	int64_t * sourcesizes, sourcesize = 0;
+	uint64_t targetdigest;
+	const char * targetpath, * patchpath;
+	struct bsdiff_digest_state digest;
 	struct bspatch_stream stream;
 
 	// Usage
-	if(argc != 4)
-		errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+	if (argc == 5 && strcmp(argv[1], "-c") == 0)
+		return compose(argv[2], argv[3], argv[4]);
+	if (argc < 4)
+		errx(1, "usage: %s oldfile [oldfile ...] newfile patchfile\n"
+		        "       %s -c patchfile1 patchfile2 patchfile\n", argv[0], argv[0]);
+	sourcecount = argc - 3;
+	targetpath = argv[argc-2];
+	patchpath = argv[argc-1];
 
-	// Opens patch file
-	if ((fp = fopen(argv[3], "rb")) == NULL)
-		errx(1, "fopen (%s)\n", argv[3]);
+	// Opens patch file and reads bsdiff header.
+	bz2 = open_patch(patchpath, &fp, &header);
+	filter = (int)((header.flags & BSDIFF_HEADER_FILTER_MASK) >> BSDIFF_HEADER_FILTER_SHIFT);
+	if (sourcecount != (int)((header.flags & BSDIFF_HEADER_REFERENCES_MASK) >> BSDIFF_HEADER_REFERENCES_SHIFT) + 1)
+		errx(1, "Patch expects %d old files\n",
+		     (int)((header.flags & BSDIFF_HEADER_REFERENCES_MASK) >> BSDIFF_HEADER_REFERENCES_SHIFT) + 1);
 
-	// Reads bsdiff header
-	if (fread(header, 1, 24, fp) != 24)
+	// Opens and reads source files (references), applying executable filter.
+	if ((sources = malloc(sourcecount * sizeof(*sources))) == NULL ||
+	    (sourcesizes = malloc(sourcecount * sizeof(*sourcesizes))) == NULL)
+		errx(1, "malloc");
+	bsdiff_digest_init(&digest);
+	for (int i = 0; i < sourcecount; ++i)
 	{
-		if (feof(fp))
-			errx(1, "Corrupt patch header\n");
-		errx(1, "fread (%s)\n", argv[3]);
+		read_file_to_buffer(argv[1+i], &sources[i], &sourcesizes[i]);
+		if (bsdiff_filter_encode(sources[i], sourcesizes[i], filter))
+			errx(1, "Unsupported filter (%s)\n", patchpath);
+		if (header.flags & BSDIFF_HEADER_SOURCE_DIGEST)
+			bsdiff_digest_update(&digest, sources[i], (size_t)sourcesizes[i]);
+		sourcesize += sourcesizes[i];
 	}
 
-	// Checks for appropriate magic
-	if (memcmp(header, "ENDSLEY/BSDIFF43", 16) != 0)
-		errx(1, "Corrupt patch header (magic)\n");
-
-	// Reads target size from header
-	targetsize = *(int64_t *)(header+16);
-	if(targetsize < 0)
-		errx(1, "Corrupt patch header (target size)\n");
+	// Verifies source before any work is done on target.
+	if (header.flags & BSDIFF_HEADER_SOURCE_DIGEST)
+	{
+		if (sourcesize != header.sourcesize)
+			errx(1, "Source size mismatch (%s)\n", argv[1]);
+		if (bsdiff_digest_final(&digest) != header.sourcedigest)
+			errx(1, "Source digest mismatch (%s)\n", argv[1]);
+	}
 
 	// Allocates target buffer.
-	if ((target = malloc(targetsize + 1)) == NULL)
-		errx(1, "malloc (%lld bytes)", targetsize + 1);
-
-	// Opens bzip2 stream.
-	if ((bz2 = BZ2_bzReadOpen(&bz2err, fp, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen (bz2err: %d)", bz2err);
+	if ((target = malloc(header.targetsize + 1)) == NULL)
+		errx(1, "malloc (%lld bytes)", header.targetsize + 1);
 
-	// Opens and reads source file.
-	read_file_to_buffer(argv[1], &source, &sourcesize);
-
-	// Applies patch.
+	// Applies patch, hashing target as it is produced only when the patch
+	// carries target digest.
 	stream.read = bz2_read;
 	stream.opaque = bz2;
-	if (bspatch(source, sourcesize, target, targetsize, &stream))
+	if (bspatch_multi((const uint8_t * const *)sources, sourcesizes, sourcecount,
+	                  target, header.targetsize, &stream,
+	                  (header.flags & BSDIFF_HEADER_TARGET_DIGEST) ? &targetdigest : NULL))
 		errx(1, "bspatch");
+	if ((header.flags & BSDIFF_HEADER_TARGET_DIGEST) && targetdigest != header.targetdigest)
+		errx(1, "Target digest mismatch\n");
 
 	// Closes patch file.
-	BZ2_bzReadClose(&bz2err, bz2);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzReadClose (bz2err: %d)", bz2err);
-	if (fclose(fp) != 0)
-		errx(1, "fclose (%s)", argv[3]);
+	close_patch(patchpath, fp, bz2);
+
+	// Reverts executable filter.
+	bsdiff_filter_decode(target, header.targetsize, filter);
 
 	// Writes the new file.
-	write_buffer_to_file(argv[2], target, targetsize);
+	write_buffer_to_file(targetpath, target, header.targetsize);
 
-	free(source);
+	for (int i = 0; i < sourcecount; ++i)
+		free(sources[i]);
+	free(sources);
+	free(sourcesizes);
 	free(target);
 	
 	return 0;
@@ -42,6 +42,42 @@ enum bspatch_stream_type
 	BSDIFF_READEXTRA,
 };
 
+// Zero-copy stream: view points buffer to at most length bytes of patch data
+// owned by the reader and updates length to the number of bytes provided.
+struct bspatch_view_stream
+{
+	void * opaque;
+	int (* view)(const struct bspatch_view_stream * stream, const void ** buffer,
+	             size_t * length, enum bspatch_stream_type type);
+};
+
+// State of streaming XXH64 digest (seed 0) of source or target.
+struct bsdiff_digest_state
+{
+	uint64_t acc[4];
+	uint64_t total;
+	uint8_t buffer[32];
+	size_t buffered;
+};
+
+// State of incremental (push-based) patching, see bspatch_begin.
+struct bspatch_state
+{
+	const uint8_t * source;
+	int64_t sourcesize;
+	uint8_t * target;
+	int64_t targetsize;
+	int64_t oldpos, newpos;
+	int64_t ctrl[3];
+	int64_t remaining;
+	enum bspatch_stream_type phase;
+	size_t ctrlsize;
+	uint8_t ctrlbuffer[24];
+	int digesting;
+	int failed;
+	struct bsdiff_digest_state digest;
+};
+
 struct bspatch_stream
 {
 	void * opaque;
@@ -52,6 +88,40 @@ struct bspatch_stream
 int bspatch(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
             const int64_t targetsize, struct bspatch_stream * stream);
 
+// Same as bspatch but also computes digest of target as it is produced.
+int bspatch_digest(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
+                   const int64_t targetsize, struct bspatch_stream * stream,
+                   uint64_t * digest);
+
+// Applies patch created by bsdiff_multi with the same list of references.
+// Digest may be NULL.
+int bspatch_multi(const uint8_t * const * sources, const int64_t * sourcesizes, int sourcecount,
+                  uint8_t * target, const int64_t targetsize, struct bspatch_stream * stream,
+                  uint64_t * digest);
+
+// Starts incremental patching. Decompressed patch data is then passed to
+// bspatch_feed in pieces of any size as it arrives and bspatch_finish checks
+// that the patch was complete. Target is hashed only when digest is nonzero;
+// bspatch_finish then returns its digest (may be NULL). Once bspatch_feed
+// fails, every further bspatch_feed and bspatch_finish fails too.
+int bspatch_begin(struct bspatch_state * state, const uint8_t * source,
+                  const int64_t sourcesize, uint8_t * target, const int64_t targetsize,
+                  int digest);
+int bspatch_feed(struct bspatch_state * state, const void * buffer, size_t size);
+int bspatch_finish(struct bspatch_state * state, uint64_t * digest);
+
+// Same as bspatch_digest but reads patch data in place via view callback.
+// Digest may be NULL.
+int bspatch_view(const uint8_t * source, const int64_t sourcesize, uint8_t * target,
+                 const int64_t targetsize, struct bspatch_view_stream * stream,
+                 uint64_t * digest);
+
+// Computes digest used in patch header incrementally or of a whole buffer.
+void bsdiff_digest_init(struct bsdiff_digest_state * state);
+void bsdiff_digest_update(struct bsdiff_digest_state * state, const void * buffer, size_t size);
+uint64_t bsdiff_digest_final(const struct bsdiff_digest_state * state);
+uint64_t bsdiff_digest(const uint8_t * buffer, int64_t size);
+
 #ifdef __cplusplus
 }
 #endif // (__cplusplus)
@@ -0,0 +1,480 @@
+/*-
+ * Copyright 2018-2020 Emanuel Komínek
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "bspatch_compose.h"
+
+#ifndef min
+# define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+# define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+// Blocks of the second patch are processed in slabs of this size.
+#define BSPATCH_SLAB_SIZE 65536
+
+// Converts signed magnitude to two's complement.
+static inline void offtin(int64_t * x)
+{
+	if (*x < 0)
+		*x = (~*x + 1) | INT64_MIN;
+}
+
+// Converts two's complement to signed magnitude.
+static inline void offtout(int64_t * x)
+{
+	if (*x < 0)
+		*x = (~*x + 1) | INT64_MIN;
+}
+
+// Pending output record is flushed once its data reaches this size.
+#define BSPATCH_COMPOSE_BUFFER_SIZE 1048576
+
+// Run of middle file described by the first patch. Runs copied from source
+// have oldpos >= 0, runs of extra data have oldpos == -1.
+struct bspatch_segment
+{
+	int64_t newpos;
+	int64_t oldpos;
+};
+
+struct bspatch_composer
+{
+	struct bsdiff_stream * output;
+	uint8_t * buffer;
+	int64_t oldpos;
+	int64_t difflen;
+	int64_t extralen;
+};
+
+static int compose_flush(struct bspatch_composer * c, int64_t nextoldpos)
+{
+	int64_t ctrl[3];
+
+	ctrl[0] = c->difflen;
+	ctrl[1] = c->extralen;
+	ctrl[2] = nextoldpos - (c->oldpos + c->difflen);
+	if (ctrl[0] || ctrl[1] || ctrl[2])
+	{
+		for (int i = 0; i <= 2; ++i)
+			offtout(ctrl + i);
+		if (c->output->write(c->output, ctrl, sizeof(ctrl), BSDIFF_WRITECONTROL) ||
+		    c->output->write(c->output, c->buffer, (size_t)c->difflen, BSDIFF_WRITEDIFF) ||
+		    c->output->write(c->output, c->buffer + c->difflen, (size_t)c->extralen, BSDIFF_WRITEEXTRA))
+			return -1;
+	}
+
+	c->oldpos = nextoldpos;
+	c->difflen = 0;
+	c->extralen = 0;
+	return 0;
+}
+
+// Appends data copied from source at oldpos (middle + delta).
+static int compose_copy(struct bspatch_composer * c, int64_t oldpos,
+                        const uint8_t * middle, const uint8_t * delta, int64_t length)
+{
+	if (c->extralen || oldpos != c->oldpos + c->difflen)
+		if (compose_flush(c, oldpos))
+			return -1;
+
+	while (length > 0)
+	{
+		int64_t len = min(length, BSPATCH_COMPOSE_BUFFER_SIZE - c->difflen);
+		if (len == 0)
+		{
+			if (compose_flush(c, c->oldpos + c->difflen))
+				return -1;
+			continue;
+		}
+		for (int64_t i = 0; i < len; ++i)
+			c->buffer[c->difflen+i] = middle[i] + delta[i];
+		c->difflen += len;
+		middle += len;
+		delta += len;
+		length -= len;
+	}
+
+	return 0;
+}
+
+// Appends extra data (middle + delta, or just middle when delta is NULL).
+static int compose_extra(struct bspatch_composer * c, const uint8_t * middle,
+                         const uint8_t * delta, int64_t length)
+{
+	while (length > 0)
+	{
+		uint8_t * out = c->buffer + c->difflen + c->extralen;
+		int64_t len = min(length, BSPATCH_COMPOSE_BUFFER_SIZE - c->difflen - c->extralen);
+		if (len == 0)
+		{
+			if (compose_flush(c, c->oldpos + c->difflen))
+				return -1;
+			continue;
+		}
+		if (delta)
+		{
+			for (int64_t i = 0; i < len; ++i)
+				out[i] = middle[i] + delta[i];
+			delta += len;
+		}
+		else
+			memcpy(out, middle, (size_t)len);
+		c->extralen += len;
+		middle += len;
+		length -= len;
+	}
+
+	return 0;
+}
+
+// Zero gaps shorter than this are stored inside a run of the first patch
+// data (a gap costs less than a new run).
+#define BSPATCH_COMPOSE_MIN_GAP 16
+
+// Run of stored data of the first patch at middle file position newpos. Data
+// of run i are bytes offset[i] .. offset[i+1] of the pool; bytes of the middle
+// file not covered by any run are zero (unchanged diff bytes).
+struct bspatch_run
+{
+	int64_t newpos;
+	int64_t offset;
+};
+
+// Diff and extra data of the first patch. Diff data are mostly zeros, so only
+// their nonzero runs are kept and memory follows the patch, not the middle file.
+struct bspatch_sparse
+{
+	struct bspatch_segment * segments;
+	int64_t count, segmentcapacity;
+	struct bspatch_run * runs;
+	int64_t runcount, runcapacity;
+	uint8_t * data;
+	int64_t size, datacapacity;
+};
+
+// Makes room for needed elements of array, returns 0 on success.
+static int compose_grow(struct bsdiff_stream * alloc, void ** array, int64_t count,
+                        int64_t * capacity, int64_t needed, size_t elemsize)
+{
+	void * grown;
+	int64_t newcapacity = *capacity ? *capacity : 1024;
+
+	if (needed <= *capacity)
+		return 0;
+	while (newcapacity < needed)
+		newcapacity *= 2;
+	if ((grown = alloc->malloc((size_t)newcapacity * elemsize)) == NULL)
+		return -1;
+	if (*array)
+	{
+		memcpy(grown, *array, (size_t)count * elemsize);
+		alloc->free(*array);
+	}
+
+	*array = grown;
+	*capacity = newcapacity;
+	return 0;
+}
+
+// Stores data of the middle file at newpos, extending previous run when adjacent.
+static int compose_store(struct bsdiff_stream * alloc, struct bspatch_sparse * p,
+                         int64_t newpos, const uint8_t * data, int64_t length)
+{
+	const struct bspatch_run * last = p->runcount ? p->runs + p->runcount - 1 : NULL;
+
+	if (last == NULL || last->newpos + (p->size - last->offset) != newpos)
+	{
+		if (compose_grow(alloc, (void **)&p->runs, p->runcount, &p->runcapacity,
+		                 p->runcount + 1, sizeof(*p->runs)))
+			return -1;
+		p->runs[p->runcount].newpos = newpos;
+		p->runs[p->runcount++].offset = p->size;
+	}
+
+	if (compose_grow(alloc, (void **)&p->data, p->size, &p->datacapacity,
+	                 p->size + length, 1))
+		return -1;
+	memcpy(p->data + p->size, data, (size_t)length);
+	p->size += length;
+	return 0;
+}
+
+// Stores nonzero runs of diff data; short zero gaps are kept inside runs.
+static int compose_store_sparse(struct bsdiff_stream * alloc, struct bspatch_sparse * p,
+                                int64_t newpos, const uint8_t * data, int64_t length)
+{
+	for (int64_t i = 0; i < length;)
+	{
+		int64_t j, k;
+
+		for (; i < length && data[i] == 0; ++i);
+		for (j = i, k = i; k < length; j = k)
+		{
+			for (; j < length && data[j] != 0; ++j);
+			for (k = j; k < length && k - j < BSPATCH_COMPOSE_MIN_GAP && data[k] == 0; ++k);
+			if (k == length || data[k] == 0)
+				break;
+		}
+
+		if (j > i && compose_store(alloc, p, newpos + i, data + i, j - i))
+			return -1;
+		i = j;
+	}
+
+	return 0;
+}
+
+// Adds segment describing origin of middle file data at newpos.
+static int compose_segment(struct bsdiff_stream * alloc, struct bspatch_sparse * p,
+                           int64_t newpos, int64_t oldpos)
+{
+	// Keeps room for the sentinel.
+	if (compose_grow(alloc, (void **)&p->segments, p->count, &p->segmentcapacity,
+	                 p->count + 2, sizeof(*p->segments)))
+		return -1;
+	p->segments[p->count].newpos = newpos;
+	p->segments[p->count++].oldpos = oldpos;
+	return 0;
+}
+
+// Reads the first patch: its diff and extra data in middle file order plus
+// list of segments describing their origin.
+static int compose_load(struct bspatch_stream * first, int64_t middlesize,
+                        struct bsdiff_stream * alloc, uint8_t * scratch,
+                        struct bspatch_sparse * p)
+{
+	int64_t oldpos = 0, newpos = 0;
+	int64_t ctrl[3];
+
+	while (newpos < middlesize)
+	{
+		if (first->read(first, ctrl, sizeof(ctrl), BSDIFF_READCONTROL))
+			return -1;
+		for (int i = 0; i <= 2; ++i)
+			offtin(ctrl + i);
+
+		// Checks sanity of control data (source size is not known here).
+		if (ctrl[0] < 0 || ctrl[0] > middlesize - newpos)
+			return -1;
+		if (oldpos < 0 || oldpos + ctrl[0] < 0)
+			return -1;
+		if (ctrl[1] < 0 || ctrl[1] > middlesize - newpos - ctrl[0])
+			return -1;
+
+		if (ctrl[0] && compose_segment(alloc, p, newpos, oldpos))
+			return -1;
+		for (int64_t done = 0, len; done < ctrl[0]; done += len)
+		{
+			len = min(ctrl[0] - done, BSPATCH_SLAB_SIZE);
+			if (first->read(first, scratch, (size_t)len, BSDIFF_READDIFF) ||
+			    compose_store_sparse(alloc, p, newpos + done, scratch, len))
+				return -1;
+		}
+		newpos += ctrl[0];
+		oldpos += ctrl[0];
+
+		if (ctrl[1] && compose_segment(alloc, p, newpos, -1))
+			return -1;
+		for (int64_t done = 0, len; done < ctrl[1]; done += len)
+		{
+			len = min(ctrl[1] - done, BSPATCH_SLAB_SIZE);
+			if (first->read(first, scratch, (size_t)len, BSDIFF_READEXTRA) ||
+			    compose_store(alloc, p, newpos + done, scratch, len))
+				return -1;
+		}
+		newpos += ctrl[1];
+		oldpos += ctrl[2];
+	}
+
+	return 0;
+}
+
+// Finds index of segment containing middle file position pos.
+static int64_t compose_find(const struct bspatch_segment * segments, int64_t count, int64_t pos)
+{
+	int64_t st = 0, en = count - 1;
+
+	while (st < en)
+	{
+		const int64_t x = st + (en - st + 1) / 2;
+		if (segments[x].newpos <= pos)
+			st = x;
+		else
+			en = x - 1;
+	}
+
+	return st;
+}
+
+// Expands stored data of middle file range into buffer.
+static void compose_expand(const struct bspatch_sparse * p, int64_t pos, int64_t length,
+                           uint8_t * buffer)
+{
+	int64_t st = 0, en = p->runcount - 1;
+
+	memset(buffer, 0, (size_t)length);
+	if (p->runcount == 0)
+		return;
+
+	// Finds the last run starting at or before pos.
+	while (st < en)
+	{
+		const int64_t x = st + (en - st + 1) / 2;
+		if (p->runs[x].newpos <= pos)
+			st = x;
+		else
+			en = x - 1;
+	}
+
+	for (int64_t r = st; r < p->runcount && p->runs[r].newpos < pos + length; ++r)
+	{
+		const int64_t end = r + 1 < p->runcount ? p->runs[r+1].offset : p->size;
+		const int64_t from = max(p->runs[r].newpos, pos);
+		const int64_t to = min(p->runs[r].newpos + (end - p->runs[r].offset), pos + length);
+		if (from < to)
+			memcpy(buffer + (from - pos), p->data + p->runs[r].offset + (from - p->runs[r].newpos),
+			       (size_t)(to - from));
+	}
+}
+
+static int compose_internal(struct bspatch_stream * second, int64_t targetsize,
+                            const struct bspatch_sparse * p, int64_t middlesize,
+                            uint8_t * scratch, uint8_t * middle, struct bspatch_composer * c)
+{
+	const struct bspatch_segment * segments = p->segments;
+	int64_t oldpos = 0, newpos = 0;
+	int64_t ctrl[3];
+
+	while (newpos < targetsize)
+	{
+		if (second->read(second, ctrl, sizeof(ctrl), BSDIFF_READCONTROL))
+			return -1;
+		for (int i = 0; i <= 2; ++i)
+			offtin(ctrl + i);
+
+		// Checks sanity of diff control data.
+		if (ctrl[0] < 0 || ctrl[0] > targetsize - newpos)
+			return -1;
+		if (oldpos < 0 || oldpos + ctrl[0] < 0 || oldpos + ctrl[0] > middlesize)
+			return -1;
+
+		// Maps diff data onto segments of the first patch.
+		for (int64_t done = 0, len; done < ctrl[0]; done += len)
+		{
+			int64_t pos = oldpos + done, k = 0;
+			int64_t s = compose_find(segments, p->count, pos);
+
+			len = min(ctrl[0] - done, BSPATCH_SLAB_SIZE);
+			if (second->read(second, scratch, (size_t)len, BSDIFF_READDIFF))
+				return -1;
+			compose_expand(p, pos, len, middle);
+
+			while (k < len)
+			{
+				const int64_t piece = min(len - k, segments[s+1].newpos - pos);
+				const int64_t result = segments[s].oldpos < 0 ?
+					compose_extra(c, middle + k, scratch + k, piece) :
+					compose_copy(c, segments[s].oldpos + (pos - segments[s].newpos),
+					             middle + k, scratch + k, piece);
+				if (result)
+					return -1;
+				pos += piece;
+				k += piece;
+				++s;
+			}
+		}
+
+		newpos += ctrl[0];
+		oldpos += ctrl[0];
+
+		// Checks sanity of extra control data.
+		if (ctrl[1] < 0 || ctrl[1] > targetsize - newpos)
+			return -1;
+
+		// Passes extra data through.
+		for (int64_t done = 0, len; done < ctrl[1]; done += len)
+		{
+			len = min(ctrl[1] - done, BSPATCH_SLAB_SIZE);
+			if (second->read(second, scratch, (size_t)len, BSDIFF_READEXTRA))
+				return -1;
+			if (compose_extra(c, scratch, NULL, len))
+				return -1;
+		}
+
+		newpos += ctrl[1];
+		oldpos += ctrl[2];
+	}
+
+	return compose_flush(c, c->oldpos + c->difflen);
+}
+
+int bspatch_compose(struct bspatch_stream * first, const int64_t middlesize,
+                    struct bspatch_stream * second, const int64_t targetsize,
+                    struct bsdiff_stream * output)
+{
+	int result = -1;
+	uint8_t * middle = NULL, * scratch = NULL;
+	struct bspatch_sparse p;
+	struct bspatch_composer c;
+
+	memset(&p, 0, sizeof(p));
+	c.output = output;
+	c.oldpos = c.difflen = c.extralen = 0;
+
+	if ((c.buffer = output->malloc(BSPATCH_COMPOSE_BUFFER_SIZE)) == NULL)
+		return -1;
+	if ((scratch = output->malloc(BSPATCH_SLAB_SIZE)) == NULL)
+		goto cleanup;
+	if ((middle = output->malloc(BSPATCH_SLAB_SIZE)) == NULL)
+		goto cleanup;
+
+	if (compose_load(first, middlesize, output, scratch, &p))
+		goto cleanup;
+	if (p.segments)
+	{
+		// Sentinel closes the last segment.
+		p.segments[p.count].newpos = middlesize;
+		p.segments[p.count].oldpos = -1;
+	}
+
+	result = compose_internal(second, targetsize, &p, middlesize, scratch, middle, &c);
+
+cleanup:
+	if (p.segments)
+		output->free(p.segments);
+	if (p.runs)
+		output->free(p.runs);
+	if (p.data)
+		output->free(p.data);
+	if (middle)
+		output->free(middle);
+	if (scratch)
+		output->free(scratch);
+	output->free(c.buffer);
+	return result;
+}